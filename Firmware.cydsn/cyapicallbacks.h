@@ -17,3 +17,12 @@
     /*For more information, refer to the Macro Callbacks topic in the PSoC Creator Help.*/
 #define USB_DP_ISR_ENTRY_CALLBACK
 void USB_DP_ISR_EntryCallback(void); // in PSoC_USB.c
+// IN endpoint transmit queues, in PSoC_USB.c. Endpoint numbers must match KBD_EP, CONSUMER_EP, SYSTEM_EP and OUTBOX_EP.
+#define USB_EP_1_ISR_EXIT_CALLBACK
+void USB_EP_1_ISR_ExitCallback(void);
+#define USB_EP_2_ISR_EXIT_CALLBACK
+void USB_EP_2_ISR_ExitCallback(void);
+#define USB_EP_3_ISR_EXIT_CALLBACK
+void USB_EP_3_ISR_ExitCallback(void);
+#define USB_EP_8_ISR_EXIT_CALLBACK
+void USB_EP_8_ISR_ExitCallback(void);
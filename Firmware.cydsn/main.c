@@ -31,8 +31,11 @@ int main()
     SysTimer_WritePeriod(BCLK__BUS_CLK__KHZ); // Need 1kHz
     SysTimer_Start();
     TimerIRQ_StartEx(Timer_ISR);
+    perf_init();
+    trace_init();
 
     load_config();
+    ext_config_check();
 
     status_register.matrix_output = 0;
     status_register.emergency_stop = 0;
@@ -52,7 +55,9 @@ int main()
                 if (tick)
                 {
                     exp_tick(tick);
+                    scan_governor_tick(tick);
                     tick = 0;
+                    scan_update_temperature();
                     if (0u != USB_IsConfigurationChanged())
                     {
                         usb_configure();
@@ -77,7 +82,11 @@ int main()
                     CyExitCriticalSection(enableInterrupts);
                     if (status_register.matrix_output > 0)
                         report_matrix_readouts();
+                    usb_wakeup_step();
+                    scan_selftest_poll();
                     pipeline_process();
+                    xlog_drain();
+                    save_config_step();
                 }
                 // Timer ISR will wake us up.
                 CyPmAltAct(PM_ALT_ACT_TIME_NONE, PM_ALT_ACT_SRC_NONE);
@@ -94,14 +103,14 @@ int main()
 #ifdef DEBUG_STATE_MACHINE
                 PIN_DEBUG(2, 3)
 #endif
-                if (tick > SUSPEND_SYSTIMER_DIVISOR)
+                if (tick >= scan_watch_interval())
                 {
                     tick = 0;
-                    scan_start();
-                    if (pipeline_process_wakeup())
-                    {
-                        usb_send_wakeup();
-                    }
+                    scan_watch_start();
+                }
+                if (scan_watch_poll() && pipeline_process_wakeup())
+                {
+                    usb_send_wakeup();
                 }
                 CyPmAltAct(PM_ALT_ACT_TIME_NONE, PM_ALT_ACT_SRC_NONE);
                 break;
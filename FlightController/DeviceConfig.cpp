@@ -1,6 +1,8 @@
 #include <QFileDialog>
 #include <QFile>
 #include <QMessageBox>
+#include <algorithm>
+#include <cstddef>
 
 #include "settings.h"
 #include "DeviceConfig.h"
@@ -8,82 +10,60 @@
 
 DeviceConfig::DeviceConfig(QObject *parent) : QObject(parent),
     bValid(false), numRows(0), numCols(0), numLayers(ABSOLUTE_MAX_LAYERS),
-    numLayerConditions(NUM_LAYER_CONDITIONS), numDelays(NUM_DELAYS), bNormallyLow(false),
-    transferDirection(TransferIdle)
+    numLayerConditions(NUM_LAYER_CONDITIONS), numDelays(NUM_DELAYS), bNormallyLow(false), bCommonModeRejection(false),
+    bTemperatureCompensation(false), bAutoThrottle(false),
+    transferDirection(TransferIdle), transferRegion(CONFIG_REGION_MAIN), transferHashing(false)
 {
     memset(this->_eeprom.raw, 0x00, sizeof(this->_eeprom));
+    memset(this->_ext.raw, EMPTY_FLASH_BYTE, sizeof(this->_ext));
 }
 
 bool DeviceConfig::eventFilter(QObject *obj __attribute__((unused)), QEvent *event){
     if (event->type() != DeviceMessage::ET )
         return false;
     QByteArray *payload = static_cast<DeviceMessage *>(event)->getPayload();
-    if (payload->at(0) != C2RESPONSE_CONFIG)
-        return false;
-
-    currentBlock++;
-    switch (transferDirection)
+    switch (payload->at(0))
     {
-        case TransferDownload:
+        case C2RESPONSE_CONFIG_V2:
+        case C2RESPONSE_EXT_CONFIG:
             _receiveConfigBlock(payload);
-            break;
-        case TransferUpload:
-            _uploadConfigBlock();
-            break;
+            return true;
+        case C2RESPONSE_CONFIG_CRC:
+            _verifyTransfer(payload);
+            return true;
+        case C2RESPONSE_CONFIG_HASHES:
+            _compareBlockHashes(payload);
+            return true;
         default:
-            qInfo() << "Received config block" << ((uint8_t)payload->at(1)) << "while supposed to be idle!";
+            return false;
     }
-    return true;
 }
 
 /**
- * @brief DeviceInterface::uploadConfig
+ * @brief DeviceConfig::toDevice
  * Fire up the uploader.
  */
 void DeviceConfig::toDevice(void)
-{
-    if ( transferDirection != TransferIdle )
-    {
-        qInfo() << "Not a good day to upload config!";
-        return;
-    }
-    this->_assemble();
-    this->transferDirection = TransferUpload;
-    this->currentBlock = 0;
-    qInfo() << "Uploading config..";
-    this->_uploadConfigBlock();
-}
-
-/**
- * @brief DeviceInterface::uploadConfigBlock
- * Upload one block to device.
- * We don't really care about the input packet here, hence (void)
- */
-void DeviceConfig::_uploadConfigBlock(void)
 {
     switch(transferDirection)
     {
+        case TransferIdle:
+            this->_assemble();
+            qInfo() << "Uploading config..";
+            _startTransfer(TransferUpload);
+            break;
         case TransferUpload:
-            if (currentBlock > (EEPROM_BYTESIZE / CONFIG_TRANSFER_BLOCK_SIZE))
+            if (transferHashing)
             {
-                qInfo() << "done!";
-                transferDirection = TransferIdle;
-                emit sendCommand(C2CMD_APPLY_CONFIG, 1);
-                return;
+                qInfo() << "Already uploading! Re-requesting block hashes just in case";
+                _startRegion();
+                break;
             }
-            qInfo(".");
-            OUT_c2packet_t msg;
-            msg.command = C2CMD_UPLOAD_CONFIG;
-            msg.payload[0] = currentBlock;
-            memcpy(
-                msg.payload + CONFIG_BLOCK_DATA_OFFSET,
-                this->_eeprom.raw+(CONFIG_TRANSFER_BLOCK_SIZE * currentBlock),
-                CONFIG_TRANSFER_BLOCK_SIZE
-            );
-            emit(uploadBlock(msg));
+            qInfo() << "Already uploading! Re-sending outstanding blocks just in case";
+            _resendInFlight();
             break;
         default:
-            qInfo() << "Not a good day to upload config block!";
+            qInfo() << "Not a good day to upload config!";
     }
 }
 
@@ -92,60 +72,253 @@ void DeviceConfig::fromDevice()
     switch(transferDirection)
     {
         case TransferIdle:
-            transferDirection = TransferDownload;
-            currentBlock = 0;
             qInfo() << "Downloading config..";
+            _startTransfer(TransferDownload);
             break;
         case TransferDownload:
-            qInfo() << "Already downloading! Re-requesting current block just in case";
+            if (transferHashing)
+            {
+                qInfo() << "Already downloading! Re-requesting block hashes just in case";
+                _startRegion();
+                break;
+            }
+            qInfo() << "Already downloading! Re-requesting outstanding blocks just in case";
+            _resendInFlight();
             break;
         default:
             qInfo() << "Not a good day to download config!";
-            return;
     }
-    emit(downloadBlock(C2CMD_DOWNLOAD_CONFIG, currentBlock));
 }
 
 /**
- * @brief DeviceInterface::_downloadConfigBlock
- * Receives one block from device, writes it to local config.
+ * @brief DeviceConfig::_startTransfer
+ * Upload goes extended config first, so that layers it adds are there by the time main config is applied.
+ * Download goes main config first - it tells how extended config is laid out.
+ */
+void DeviceConfig::_startTransfer(enum TransferDirection direction)
+{
+    transferDirection = direction;
+    transferRegion = (direction == TransferUpload) ? CONFIG_REGION_EXTENDED : CONFIG_REGION_MAIN;
+    _startRegion();
+}
+
+/**
+ * @brief DeviceConfig::_startRegion
+ * Starts by fetching block hashes - only blocks that differ from local copy get transferred.
+ */
+void DeviceConfig::_startRegion(void)
+{
+    transferHashing = true;
+    transferQueue.clear();
+    transferInFlight.clear();
+    _requestBlockHashes(0);
+}
+
+void DeviceConfig::_requestBlockHashes(uint8_t first)
+{
+    OUT_c2packet_t msg;
+    memset(msg.raw, 0, sizeof(msg));
+    msg.command = C2CMD_CONFIG_HASHES;
+    msg.payload[0] = first;
+    msg.payload[1] = transferRegion;
+    emit sendCommand(msg);
+}
+
+uint8_t *DeviceConfig::_regionImage(void)
+{
+    return (transferRegion == CONFIG_REGION_EXTENDED) ? this->_ext.raw : this->_eeprom.raw;
+}
+
+uint16_t DeviceConfig::_regionSize(void)
+{
+    return (transferRegion == CONFIG_REGION_EXTENDED) ? sizeof(this->_ext.raw) : sizeof(this->_eeprom.raw);
+}
+
+uint8_t DeviceConfig::_regionBlockSize(void)
+{
+    return (transferRegion == CONFIG_REGION_EXTENDED) ? EXT_CONFIG_BLOCK_SIZE : CONFIG_V2_BLOCK_SIZE;
+}
+
+uint8_t DeviceConfig::_regionBlocks(void)
+{
+    return (_regionSize() + _regionBlockSize() - 1) / _regionBlockSize();
+}
+
+uint16_t DeviceConfig::_regionBlockLength(uint8_t block)
+{
+    return std::min<uint16_t>(_regionBlockSize(), _regionSize() - block * _regionBlockSize());
+}
+
+void DeviceConfig::_compareBlockHashes(QByteArray *payload)
+{
+    if (transferDirection == TransferIdle || !transferHashing)
+    {
+        qInfo() << "Received unexpected config hashes";
+        return;
+    }
+    uint8_t first = payload->at(1);
+    uint8_t count = payload->at(2);
+    for (uint8_t i = 0; i < count; i++)
+    {
+        uint8_t block = first + i;
+        uint16_t deviceHash = (uint8_t)payload->at(3 + i*2) | ((uint8_t)payload->at(4 + i*2) << 8);
+        uint16_t localHash = qChecksum(
+            (const char *)_regionImage() + (_regionBlockSize() * block),
+            _regionBlockLength(block)
+        );
+        if (deviceHash != localHash)
+            transferQueue.push_back(block);
+    }
+    if (count > 0 && first + count < _regionBlocks())
+    {
+        _requestBlockHashes(first + count);
+        return;
+    }
+    transferHashing = false;
+    qInfo() << transferQueue.size() << "of" << _regionBlocks() << "blocks differ";
+    _sendConfigBlocks();
+}
+
+void DeviceConfig::_resendInFlight(void)
+{
+    for (uint8_t block : transferInFlight)
+        transferQueue.push_front(block);
+    transferInFlight.clear();
+    _sendConfigBlocks();
+}
+
+/**
+ * @brief DeviceConfig::_sendConfigBlocks
+ * Tops up the window of outstanding blocks. Once everything is acknowledged,
+ * asks device for the image CRC - the transfer is only done when it matches.
+ */
+void DeviceConfig::_sendConfigBlocks(void)
+{
+    bool extended = (transferRegion == CONFIG_REGION_EXTENDED);
+    while (transferInFlight.size() < CONFIG_V2_WINDOW && !transferQueue.empty())
+    {
+        uint8_t block = transferQueue.front();
+        transferQueue.pop_front();
+        transferInFlight.insert(block);
+        OUT_c2packet_t msg;
+        memset(msg.raw, 0, sizeof(msg));
+        msg.payload[0] = block;
+        if (transferDirection == TransferUpload)
+        {
+            msg.command = extended ? C2CMD_UPLOAD_EXT_CONFIG : C2CMD_UPLOAD_CONFIG_V2;
+            memcpy(
+                msg.payload + 1,
+                _regionImage() + (_regionBlockSize() * block),
+                _regionBlockLength(block)
+            );
+        }
+        else
+        {
+            msg.command = extended ? C2CMD_DOWNLOAD_EXT_CONFIG : C2CMD_DOWNLOAD_CONFIG_V2;
+        }
+        emit sendCommand(msg);
+    }
+    if (transferInFlight.empty() && transferQueue.empty())
+    {
+        qInfo() << "verifying..";
+        emit sendCommand(C2CMD_CONFIG_CRC, (uint8_t)transferRegion);
+    }
+}
+
+/**
+ * @brief DeviceConfig::_receiveConfigBlock
+ * Handles block ack (upload) or block data (download), then keeps the window full.
  * @param payload - packet payload
  */
 void DeviceConfig::_receiveConfigBlock(QByteArray *payload)
 {
-    if ( transferDirection != TransferDownload )
+    uint8_t block = payload->at(1);
+    enum configRegion region = (payload->at(0) == C2RESPONSE_EXT_CONFIG) ? CONFIG_REGION_EXTENDED : CONFIG_REGION_MAIN;
+    if (transferDirection == TransferIdle || region != transferRegion || transferInFlight.erase(block) == 0)
     {
-        qInfo() << "Not a good day to download config block!";
+        qInfo() << "Received unexpected config block" << (int)block;
         return;
     }
-    if (currentBlock >= (EEPROM_BYTESIZE / CONFIG_TRANSFER_BLOCK_SIZE))
+    qInfo(".");
+    if (transferDirection == TransferDownload)
+    {
+        memcpy(
+            _regionImage() + (_regionBlockSize() * block),
+            payload->data() + 2,
+            _regionBlockLength(block)
+        );
+    }
+    _sendConfigBlocks();
+}
+
+void DeviceConfig::_verifyTransfer(QByteArray *payload)
+{
+    enum TransferDirection direction = transferDirection;
+    if (direction == TransferIdle || transferHashing || !transferInFlight.empty() || !transferQueue.empty())
+        return;
+    uint16_t deviceCrc = (uint8_t)payload->at(1) | ((uint8_t)payload->at(2) << 8);
+    uint16_t localCrc = qChecksum((const char *)_regionImage(), _regionSize());
+    if (deviceCrc != localCrc)
     {
         transferDirection = TransferIdle;
+        qWarning() << "Config CRC mismatch, device:" << deviceCrc << "local:" << localCrc << "- transfer failed!";
+        return;
+    }
+    if (direction == TransferUpload && transferRegion == CONFIG_REGION_EXTENDED)
+    {
+        transferRegion = CONFIG_REGION_MAIN;
+        _startRegion();
+        return;
+    }
+    if (direction == TransferDownload && transferRegion == CONFIG_REGION_MAIN)
+    {
+        transferRegion = CONFIG_REGION_EXTENDED;
+        _startRegion();
+        return;
+    }
+    transferDirection = TransferIdle;
+    if (direction == TransferUpload)
+    {
+        qInfo() << "done!";
+        // Device applies only the image we just verified.
+        OUT_c2packet_t msg;
+        memset(msg.raw, 0, sizeof(msg));
+        msg.command = C2CMD_APPLY_CONFIG;
+        msg.payload[0] = CONFIG_APPLY_CHECKED;
+        msg.payload[1] = localCrc & 0xff;
+        msg.payload[2] = localCrc >> 8;
+        emit sendCommand(msg);
+    }
+    else
+    {
         qInfo() << "done, unpacking...";
         _unpack();
-        return;
     }
-    qInfo(".");
-    memcpy(
-        this->_eeprom.raw+(CONFIG_TRANSFER_BLOCK_SIZE * (uint8_t)payload->at(1)),
-        payload->data() + 1 + CONFIG_BLOCK_DATA_OFFSET,
-        CONFIG_TRANSFER_BLOCK_SIZE
-    );
-    emit(downloadBlock(C2CMD_DOWNLOAD_CONFIG, currentBlock));
 }
 
 void DeviceConfig::_unpack(void)
 {
     numRows   = _eeprom.matrixRows;
     numCols   = _eeprom.matrixCols;
-    numLayers = _eeprom.matrixLayers;
+    // Layers past EEPROM ones live in extended config. Show all of them, empty if it's not there.
+    numLayers = ABSOLUTE_MAX_LAYERS;
     bNormallyLow = _eeprom.capsenseFlags & (1 << CSF_NL);
+    bCommonModeRejection = _eeprom.capsenseFlags & (1 << CSF_CMR);
+    bTemperatureCompensation = _eeprom.capsenseFlags & (1 << CSF_TC);
+    bAutoThrottle = _eeprom.capsenseFlags & (1 << CSF_AT);
     guardLo   = _eeprom.guardLo;
     guardHi   = _eeprom.guardHi;
+    if (_eeprom.tailMagic != CONFIG_TAIL_MAGIC)
+    {
+        // Written before tail existed - those are macro bytes, not settings.
+        memset(_eeprom.crosstalk, EMPTY_FLASH_BYTE, offsetof(psoc_eeprom_t, tailMagic) - offsetof(psoc_eeprom_t, crosstalk));
+    }
     memset(deadBandLo, EMPTY_FLASH_BYTE, sizeof(deadBandLo));
     memset(deadBandHi, EMPTY_FLASH_BYTE, sizeof(deadBandHi));
     memset(layouts, 0x00, sizeof(layouts));
     uint8_t table_size = numRows * numCols;
+    bool extValid = _ext.extVersion == EXT_CONFIG_VERSION
+        && _ext.extCrc == qChecksum((const char *)_ext.raw, offsetof(ext_config_t, extCrc));
     for (uint8_t i = 0; i < numRows; i++)
     {
         for (uint8_t j = 0; j < numCols; j++)
@@ -154,10 +327,14 @@ void DeviceConfig::_unpack(void)
             this->deadBandLo[i][j] = _eeprom.stash[offset];
             this->deadBandHi[i][j] = _eeprom.stash[table_size + offset];
             this->skipSensing[i][j] = (deadBandLo[i][j] > deadBandHi[i][j]);
-            for (uint8_t k = 0; k < numLayers; k++)
+            for (uint8_t k = 0; k < _eeprom.matrixLayers; k++)
             {
                 layouts[k][i][j] = _eeprom.stash[table_size*(k+2) + offset];
             }
+            for (uint8_t k = _eeprom.matrixLayers; extValid && k < std::min(ABSOLUTE_MAX_LAYERS, _eeprom.matrixLayers + _ext.extLayerCount); k++)
+            {
+                layouts[k][i][j] = _ext.stash[table_size*(k - _eeprom.matrixLayers) + offset];
+            }
         }
     }
     this->bValid = true;
@@ -168,8 +345,21 @@ void DeviceConfig::_unpack(void)
 void DeviceConfig::_assemble(void)
 {
     _eeprom.configVersion = 2;
+    _eeprom.tailMagic = CONFIG_TAIL_MAGIC;
     _eeprom.guardLo = guardLo;
     _eeprom.guardHi = guardHi;
+    if (bCommonModeRejection)
+        _eeprom.capsenseFlags |= (1 << CSF_CMR);
+    else
+        _eeprom.capsenseFlags &= ~(1 << CSF_CMR);
+    if (bTemperatureCompensation && hasTemperatureCompensation())
+        _eeprom.capsenseFlags |= (1 << CSF_TC);
+    else
+        _eeprom.capsenseFlags &= ~(1 << CSF_TC);
+    if (bAutoThrottle)
+        _eeprom.capsenseFlags |= (1 << CSF_AT);
+    else
+        _eeprom.capsenseFlags &= ~(1 << CSF_AT);
     memset(_eeprom.stash, EMPTY_FLASH_BYTE, sizeof(_eeprom.stash));
     memset(_eeprom._RESERVED0, EMPTY_FLASH_BYTE, sizeof(_eeprom._RESERVED0));
     memset(_eeprom._RESERVED1, EMPTY_FLASH_BYTE, sizeof(_eeprom._RESERVED1));
@@ -187,13 +377,23 @@ void DeviceConfig::_assemble(void)
             }
             _eeprom.stash[offset] = deadBandLo[i][j];
             _eeprom.stash[table_size + offset] = deadBandHi[i][j];
-            for (uint8_t k = 0; k < numLayers; k++)
+            for (uint8_t k = 0; k < _eeprom.matrixLayers; k++)
             {
                 this->_eeprom.stash[table_size*(k+2) + offset] = this->layouts[k][i][j];
             }
+            for (uint8_t k = _eeprom.matrixLayers; k < numLayers; k++)
+            {
+                this->_ext.stash[table_size*(k - _eeprom.matrixLayers) + offset] = this->layouts[k][i][j];
+            }
         }
     }
-    uint16_t macros_start = table_size * (numLayers + 2);
+    // Extended config macros are kept as they came from device.
+    _ext.extVersion = EXT_CONFIG_VERSION;
+    _ext.extLayerCount = numLayers - _eeprom.matrixLayers;
+    memset(_ext._RESERVED_EXT, EMPTY_FLASH_BYTE, sizeof(_ext._RESERVED_EXT));
+    memset(_ext._RESERVED_EXT_TAIL, EMPTY_FLASH_BYTE, sizeof(_ext._RESERVED_EXT_TAIL));
+    _ext.extCrc = qChecksum((const char *)_ext.raw, offsetof(ext_config_t, extCrc));
+    uint16_t macros_start = table_size * (_eeprom.matrixLayers + 2);
     /*
     // Crude memcpy of a test macro F24 -> Shift-A
     static const uint8_t filler[] = {
@@ -330,3 +530,78 @@ void DeviceConfig::setExpHeaderParams(uint8_t mode, uint8_t param1, uint8_t para
     _eeprom.expParam1 = param1;
     _eeprom.expParam2 = param2;
 }
+
+std::vector<crosstalk_entry_t> DeviceConfig::crosstalk(void)
+{
+    std::vector<crosstalk_entry_t> retval;
+    for (uint8_t i = 0; i < CROSSTALK_ENTRIES && _eeprom.crosstalk[i].victim != EMPTY_FLASH_BYTE; i++)
+    {
+        retval.push_back(_eeprom.crosstalk[i]);
+    }
+    return retval;
+}
+
+void DeviceConfig::setCrosstalk(std::vector<crosstalk_entry_t> entries)
+{
+    if (entries.size() > CROSSTALK_ENTRIES)
+    {
+        qWarning() << "Crosstalk table overflow," << entries.size() - CROSSTALK_ENTRIES << "entries dropped!";
+        entries.resize(CROSSTALK_ENTRIES);
+    }
+    memset(_eeprom.crosstalk, EMPTY_FLASH_BYTE, sizeof(_eeprom.crosstalk));
+    for (size_t i = 0; i < entries.size(); i++)
+    {
+        _eeprom.crosstalk[i] = entries[i];
+    }
+}
+
+std::vector<uint8_t> DeviceConfig::hotKeys(void)
+{
+    std::vector<uint8_t> retval;
+    for (uint8_t i = 0; i < HOT_KEYS_MAX && _eeprom.hotKeys[i] != EMPTY_FLASH_BYTE; i++)
+    {
+        retval.push_back(_eeprom.hotKeys[i]);
+    }
+    return retval;
+}
+
+uint8_t DeviceConfig::hotRowRate(void)
+{
+    return (_eeprom.hotRowRate == EMPTY_FLASH_BYTE || _eeprom.hotRowRate == 0) ? 1 : _eeprom.hotRowRate;
+}
+
+void DeviceConfig::setHotKeys(std::vector<uint8_t> scancodes, uint8_t rate)
+{
+    if (scancodes.size() > HOT_KEYS_MAX)
+    {
+        qWarning() << "Too many hot keys," << scancodes.size() - HOT_KEYS_MAX << "dropped!";
+        scancodes.resize(HOT_KEYS_MAX);
+    }
+    memset(_eeprom.hotKeys, EMPTY_FLASH_BYTE, sizeof(_eeprom.hotKeys));
+    for (size_t i = 0; i < scancodes.size(); i++)
+    {
+        _eeprom.hotKeys[i] = scancodes[i];
+    }
+    _eeprom.hotRowRate = std::min(rate, (uint8_t)HOT_ROW_RATE_MAX);
+}
+
+std::vector<int8_t> DeviceConfig::temperatureCompensation(void)
+{
+    std::vector<int8_t> retval;
+    retval.push_back(_eeprom.temperatureReference);
+    retval.push_back(_eeprom.temperatureSlope);
+    return retval;
+}
+
+// -1 reads as erased EEPROM to firmware. -1C or -1/16 per degree is close enough to zero.
+void DeviceConfig::setTemperatureCompensation(int8_t reference, int8_t slope)
+{
+    _eeprom.temperatureReference = (reference == (int8_t)EMPTY_FLASH_BYTE) ? 0 : reference;
+    _eeprom.temperatureSlope = (slope == (int8_t)EMPTY_FLASH_BYTE) ? 0 : slope;
+}
+
+bool DeviceConfig::hasTemperatureCompensation(void)
+{
+    return _eeprom.temperatureReference != (int8_t)EMPTY_FLASH_BYTE
+        && _eeprom.temperatureSlope != (int8_t)EMPTY_FLASH_BYTE;
+}
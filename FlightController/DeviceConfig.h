@@ -2,6 +2,8 @@
 #define DEVICECONFIG_H
 
 #include <QObject>
+#include <deque>
+#include <set>
 #include "Events.h"
 #include "../c2/nvram.h"
 #include "LayerCondition.h"
@@ -21,6 +23,7 @@ public:
     uint8_t numLayerConditions;
     uint8_t numDelays;
     bool    bNormallyLow;
+    bool    bCommonModeRejection;
     uint8_t guardHi;
     uint8_t guardLo;
     uint8_t deadBandLo[ABSOLUTE_MAX_ROWS][ABSOLUTE_MAX_COLS];
@@ -34,12 +37,21 @@ public:
     void setDelay(int delayIdx, uint16_t delay_ms);
     std::vector<uint8_t> expHeaderParams(void);
     void setExpHeaderParams(uint8_t mode, uint8_t param1, uint8_t param2);
+    std::vector<crosstalk_entry_t> crosstalk(void);
+    void setCrosstalk(std::vector<crosstalk_entry_t> entries);
+    std::vector<uint8_t> hotKeys(void);
+    uint8_t hotRowRate(void);
+    void setHotKeys(std::vector<uint8_t> scancodes, uint8_t rate);
+    bool    bTemperatureCompensation;
+    bool    bAutoThrottle;
+    std::vector<int8_t> temperatureCompensation(void);
+    void setTemperatureCompensation(int8_t reference, int8_t slope);
+    bool hasTemperatureCompensation(void);
 
 signals:
     void changed(void);
-    void uploadBlock(OUT_c2packet_t);
-    void downloadBlock(c2command, uint8_t);
     void sendCommand(c2command, uint8_t);
+    void sendCommand(OUT_c2packet_t);
 
 public slots:
     void fromDevice(void);
@@ -54,10 +66,25 @@ protected:
 
 private:
     psoc_eeprom_t _eeprom;
+    ext_config_t _ext;
     enum TransferDirection transferDirection;
-    uint8_t currentBlock;
-    void _uploadConfigBlock(void);
+    enum configRegion transferRegion;
+    bool transferHashing;
+    std::deque<uint8_t> transferQueue;
+    std::set<uint8_t> transferInFlight;
+    void _startTransfer(enum TransferDirection direction);
+    void _startRegion(void);
+    void _requestBlockHashes(uint8_t first);
+    uint8_t *_regionImage(void);
+    uint16_t _regionSize(void);
+    uint8_t _regionBlockSize(void);
+    uint8_t _regionBlocks(void);
+    uint16_t _regionBlockLength(uint8_t block);
+    void _compareBlockHashes(QByteArray *);
+    void _resendInFlight(void);
+    void _sendConfigBlocks(void);
     void _receiveConfigBlock(QByteArray *);
+    void _verifyTransfer(QByteArray *);
     void _unpack(void);
     void _assemble(void);
 
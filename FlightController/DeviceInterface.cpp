@@ -7,16 +7,14 @@
 
 
 DeviceInterface::DeviceInterface(QObject *parent): QObject(parent),
-    device(NULL), pollTimerId(0), mode(DeviceInterfaceNormal), currentStatus(DeviceDisconnected)
+    dieTemperature(0), device(NULL), pollTimerId(0), mode(DeviceInterfaceNormal), currentStatus(DeviceDisconnected)
 {
     config = new DeviceConfig();
     installEventFilter(config);
 
     connect(config, SIGNAL(changed()), this, SLOT(configChanged()));
-    connect(config, SIGNAL(downloadBlock(c2command, uint8_t)), this, SLOT(sendCommand(c2command, uint8_t)));
-    connect(config, SIGNAL(uploadBlock(OUT_c2packet_t)), this, SLOT(sendCommand(OUT_c2packet_t)));
-
     connect(config, SIGNAL(sendCommand(c2command, uint8_t)), this, SLOT(sendCommand(c2command, uint8_t)));
+    connect(config, SIGNAL(sendCommand(OUT_c2packet_t)), this, SLOT(sendCommand(OUT_c2packet_t)));
 }
 
 DeviceInterface::~DeviceInterface(void)
@@ -36,6 +34,7 @@ bool DeviceInterface::event(QEvent* e)
         switch (payload->at(0))
         {
         case C2RESPONSE_STATUS:
+            dieTemperature = (payload->at(4) == 1 ? 1 : -1) * (uint8_t)payload->at(5);
             qInfo().nospace() << "CommonSense v" << (uint8_t)payload->at(2) << "." << (uint8_t)payload->at(3)
                               << ", die temp " << (payload->at(4) == 1 ? '+' : '-') << (uint8_t)payload->at(5) << "C";
             qInfo().nospace() << "Quenched: " << (bool)(payload->at(1) & (1 << C2DEVSTATUS_EMERGENCY))
@@ -55,6 +54,102 @@ bool DeviceInterface::event(QEvent* e)
             emit scancodeReceived(row, col, (scancode & scancodeReleased) ? KeyReleased : KeyPressed);
             qInfo().noquote() << QString((scancode & scancodeReleased) ? "+" : " -") << row+1 << col+1;
             return true;
+        case C2RESPONSE_HEALTH:
+        {
+            uint8_t rows = payload->at(1);
+            uint8_t cols = payload->at(2);
+            uint8_t quarantined = 0;
+            for (uint8_t i = 0; i < rows; i++)
+            {
+                uint32_t bitmap;
+                memcpy(&bitmap, payload->constData() + 3 + i * sizeof(bitmap), sizeof(bitmap));
+                for (uint8_t j = 0; j < cols; j++)
+                {
+                    if (bitmap & (1 << j))
+                    {
+                        qWarning().nospace() << "Key " << i+1 << ":" << j+1 << " is quarantined";
+                        emit keyQuarantined(i, j);
+                        quarantined++;
+                    }
+                }
+            }
+            if (quarantined == 0)
+                qInfo() << "All keys healthy";
+            return true;
+        }
+        case C2RESPONSE_PERF:
+        {
+            perf_counters_t perf;
+            memcpy(perf.raw, payload->constData() + 1, sizeof(perf));
+            double cyclesPerUs = perf.busClockKHz / 1000.0;
+            qInfo().nospace() << "Uptime " << perf.uptime / 1000 << "s, "
+                              << perf.scanPassesPerSecond << " scan passes/s";
+            qInfo().nospace() << "Result ISR: max " << perf.isrCyclesMax / cyclesPerUs << "us, avg "
+                              << (perf.isrRuns ? perf.isrCyclesTotal / perf.isrRuns / cyclesPerUs : 0) << "us over "
+                              << perf.isrRuns << " runs";
+            qInfo().nospace() << "Scancode buffer: high water " << (int)perf.scancodeHighWater
+                              << ", dropped " << perf.scancodeDrops;
+            qInfo().nospace() << "USB queue: " << (int)perf.usbQueueOccupancy << " queued, high water "
+                              << (int)perf.usbQueueHighWater;
+            qInfo().nospace() << "USB: " << perf.reportsCollapsed << " reports collapsed, " << perf.c2Drops << " control packets dropped, sent "
+                              << perf.reportsKBD << " keyboard, " << perf.reportsCONSUMER << " consumer, "
+                              << perf.reportsSYSTEM << " system, " << perf.reportsC2 << " control packets";
+            qInfo().nospace() << "Log messages dropped: " << perf.logDrops;
+            QDebug residency = qInfo().nospace();
+            residency << "Scan rate " << (int)perf.scanRate << ", seconds at each rate:";
+            for (uint8_t i = 0; i < SCAN_RATES; i++)
+                residency << " " << perf.scanRateResidency[i];
+            return true;
+        }
+        case C2RESPONSE_POWER:
+        {
+            power_counters_t power;
+            memcpy(power.raw, payload->constData() + 1, sizeof(power));
+            qInfo().nospace() << "Power: " << power.suspends << " suspends, " << power.hostResumes << " host resumes, "
+                              << power.remoteWakeups << " remote wakeups, last suspend " << power.lastSuspendMs << "ms";
+            qInfo().nospace() << "Resume: last " << power.resumeUsLast << "us, max " << power.resumeUsMax
+                              << "us, remote wakeup signalling " << power.wakeupSignalMs << "ms, first key "
+                              << (power.firstKeyMs == UINT16_MAX ? QString("pending") : QString("%1ms").arg(power.firstKeyMs));
+            return true;
+        }
+        case C2RESPONSE_SCAN_INTEGRITY:
+        {
+            scan_integrity_t integrity;
+            memcpy(integrity.raw, payload->constData() + 1, sizeof(integrity));
+            qInfo().nospace() << "Scan integrity: " << integrity.rowTransfers << " rows, " << integrity.isrOverruns
+                              << " ISR overruns, " << integrity.transfersDeferred << " transfers deferred, "
+                              << integrity.rowsSkipped << " rows skipped, " << integrity.passesFaulted << " passes faulted";
+            qInfo().nospace() << "Scan slack " << (int)integrity.slack << ", max " << (int)integrity.slackMax
+                              << ", last fault " << (integrity.lastFaultMs ? QString("at %1ms").arg(integrity.lastFaultMs) : QString("never"));
+            return true;
+        }
+        case C2RESPONSE_LOG:
+        {
+            const uint8_t *records = (const uint8_t *)payload->constData() + 1;
+            uint8_t count = records[0];
+            uint8_t pos = 1;
+            for (uint8_t i = 0; i < count && pos + 2 <= 63; i++)
+            {
+                uint8_t id = records[pos];
+                uint8_t argc = std::min(records[pos + 1], (uint8_t)LOG_MAX_ARGS);
+                int32_t args[LOG_MAX_ARGS] = {0};
+                if (pos + 2 + argc * sizeof(int32_t) > 63)
+                {
+                    break;
+                }
+                memcpy(args, records + pos + 2, argc * sizeof(int32_t));
+                pos += 2 + argc * sizeof(int32_t);
+                if (id < LOG_MESSAGE_COUNT)
+                {
+                    qInfo().noquote() << QString::asprintf(logFormats[id], args[0], args[1], args[2], args[3], args[4]);
+                }
+                else
+                {
+                    qInfo() << "Unknown log message" << (int)id << "- FlightController is older than firmware?";
+                }
+            }
+            return true;
+        }
         default:
             qInfo() << payload->constData();
             return true;
@@ -235,7 +330,10 @@ hid_device* DeviceInterface::acquireDevice(void)
             qInfo() << "Trying to use" << d->path;
             retval = hid_open_path(d->path);
             if (retval)
+            {
+                serialNumber = d->serial_number ? QString::fromWCharArray(d->serial_number) : QString();
                 break;
+            }
             qInfo() << "Cannot open device. Linux permissions problem?";
         }
         d = d->next;
@@ -29,6 +29,8 @@ class DeviceInterface : public QObject
         bool event(QEvent* e);
         device_status_t* getStatus(void);
         DeviceConfig* config;
+        int8_t dieTemperature;
+        QString serialNumber;
         enum DeviceStatus {DeviceConnected, DeviceDisconnected, DeviceConfigChanged, BootloaderConnected};
         enum KeyStatus {KeyPressed, KeyReleased};
         enum Mode {DeviceInterfaceNormal, DeviceInterfaceBootloader};
@@ -44,6 +46,7 @@ class DeviceInterface : public QObject
     signals:
         void deviceStatusNotification(DeviceInterface::DeviceStatus);
         void scancodeReceived(uint8_t row, uint8_t col, DeviceInterface::KeyStatus status);
+        void keyQuarantined(uint8_t row, uint8_t col);
 
     protected:
         virtual void timerEvent(QTimerEvent *);
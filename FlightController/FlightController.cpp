@@ -33,6 +33,8 @@ FlightController::FlightController(QWidget *parent) :
     thresholdEditor = new ThresholdEditor(di.config);
     connect(&di, SIGNAL(scancodeReceived(uint8_t, uint8_t, DeviceInterface::KeyStatus)),
             thresholdEditor, SLOT(receiveScancode(uint8_t, uint8_t, DeviceInterface::KeyStatus)));
+    connect(&di, SIGNAL(keyQuarantined(uint8_t, uint8_t)),
+            thresholdEditor, SLOT(receiveQuarantine(uint8_t, uint8_t)));
 
     layerConditions = new LayerConditions(di.config);
 
@@ -40,6 +42,10 @@ FlightController::FlightController(QWidget *parent) :
 
     _expHeader = new ExpansionHeader(di.config);
 
+    _recorder = new FlightRecorder(this);
+
+    _selfTest = new SelfTest(this);
+
     // Must be last in chain to intercept all packets!
     loader = new FirmwareLoader();
     connect(loader, SIGNAL(switchMode(bool)), &di, SLOT(bootloaderMode(bool)));
@@ -88,6 +94,11 @@ void FlightController::setup(void)
     connect(ui->action_Save, SIGNAL(triggered()), di.config, SLOT(toFile()));
     connect(ui->action_Commit, SIGNAL(triggered()), di.config, SLOT(commit()));
     connect(ui->action_Rollback, SIGNAL(triggered()), di.config, SLOT(rollback()));
+    connect(ui->action_Trace_arm, SIGNAL(triggered()), _recorder, SLOT(arm()));
+    connect(ui->action_Trace_freeze, SIGNAL(triggered()), _recorder, SLOT(freeze()));
+    connect(ui->action_Trace_download, SIGNAL(triggered()), _recorder, SLOT(download()));
+    connect(ui->action_Self_test, SIGNAL(triggered()), _selfTest, SLOT(run()));
+    connect(ui->action_Clear_self_test_baseline, SIGNAL(triggered()), _selfTest, SLOT(clearBaseline()));
     connect(this, SIGNAL(sendCommand(c2command, uint8_t)), &di, SLOT(sendCommand(c2command, uint8_t)));
     connect(&di, SIGNAL(deviceStatusNotification(DeviceInterface::DeviceStatus)), this, SLOT(deviceStatusNotification(DeviceInterface::DeviceStatus)));
     lockUI(true);
@@ -147,6 +158,8 @@ void FlightController::redButtonToggle(bool state)
 void FlightController::statusRequestButtonClick(void)
 {
     emit sendCommand(C2CMD_GET_STATUS, 0);
+    emit sendCommand(C2CMD_GET_HEALTH, 0);
+    emit sendCommand(C2CMD_GET_PERF, 0);
 }
 
 void FlightController::deviceStatusNotification(DeviceInterface::DeviceStatus s)
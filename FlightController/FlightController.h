@@ -20,6 +20,8 @@
 #include "FirmwareLoader.h"
 #include "Delays.h"
 #include "ExpansionHeader.h"
+#include "FlightRecorder.h"
+#include "SelfTest.h"
 
 namespace Ui {
 class FlightController;
@@ -64,6 +66,8 @@ private:
     LayerConditions *layerConditions;
     Delays *_delays;
     ExpansionHeader *_expHeader;
+    FlightRecorder *_recorder;
+    SelfTest *_selfTest;
     FirmwareLoader *loader;
     QtMessageHandler *_oldLogger;
     void lockUI(bool lock);
@@ -41,11 +41,14 @@ SOURCES += main.cpp \
     CyACD.cpp \
     LayerCondition.cpp \
     Delays.cpp \
-    ExpansionHeader.cpp
+    ExpansionHeader.cpp \
+    FlightRecorder.cpp \
+    SelfTest.cpp
 
 HEADERS  += \
     ../c2/c2_protocol.h \
     ../c2/nvram.h \
+    ../c2/log_messages.h \
     call_once.h \
     singleton.h \
     settings.h \
@@ -63,7 +66,9 @@ HEADERS  += \
     CyACD.h \
     LayerCondition.h \
     Delays.h \
-    ExpansionHeader.h
+    ExpansionHeader.h \
+    FlightRecorder.h \
+    SelfTest.h
 
 FORMS    += \
     FlightController.ui \
@@ -0,0 +1,129 @@
+/*
+ *
+ * Copyright (C) 2017 DMA <dma@ya.ru>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+*/
+#include <QFileDialog>
+
+#include "FlightRecorder.h"
+#include "DeviceInterface.h"
+#include "singleton.h"
+#include "settings.h"
+#include "Events.h"
+
+FlightRecorder::FlightRecorder(QObject *parent) : QObject(parent),
+    _time(0), _lastTimestamp(0), _events(0), _resync(false)
+{
+    DeviceInterface &di = Singleton<DeviceInterface>::instance();
+    di.installEventFilter(this);
+    connect(this, SIGNAL(sendCommand(OUT_c2packet_t)), &di, SLOT(sendCommand(OUT_c2packet_t)));
+}
+
+void FlightRecorder::_sendTraceCommand(traceCommand cmd, uint16_t chunk)
+{
+    OUT_c2packet_t packet;
+    memset(packet.raw, 0, sizeof(packet));
+    packet.command = C2CMD_TRACE;
+    packet.payload[0] = cmd;
+    packet.payload[1] = chunk & 0xff;
+    packet.payload[2] = chunk >> 8;
+    emit sendCommand(packet);
+}
+
+void FlightRecorder::arm(void)
+{
+    qInfo() << "Flight recorder armed.";
+    _sendTraceCommand(TRACE_ARM, 0);
+}
+
+void FlightRecorder::freeze(void)
+{
+    qInfo() << "Flight recorder frozen.";
+    _sendTraceCommand(TRACE_FREEZE, 0);
+}
+
+void FlightRecorder::download(void)
+{
+    QSettings settings;
+    QFileDialog fd(Q_NULLPTR, "Choose one file to save trace to");
+    fd.setDirectory(settings.value(SETTINGS_DIR_KEY).toString());
+    fd.setNameFilter(tr("Event trace(*.csv)"));
+    fd.setDefaultSuffix(QString("csv"));
+    fd.setAcceptMode(QFileDialog::AcceptSave);
+    if (!fd.exec())
+    {
+        return;
+    }
+    _file.setFileName(fd.selectedFiles().at(0));
+    if (!_file.open(QIODevice::WriteOnly))
+    {
+        qWarning() << "Cannot open" << _file.fileName();
+        return;
+    }
+    _stream.setDevice(&_file);
+    _stream << "Cycles,Time_us,Event,Arg8,Arg16\n";
+    _time = 0;
+    _events = 0;
+    _resync = false;
+    _sendTraceCommand(TRACE_DOWNLOAD, 0);
+}
+
+bool FlightRecorder::eventFilter(QObject *obj __attribute__((unused)), QEvent *event)
+{
+    if (event->type() != DeviceMessage::ET)
+    {
+        return false;
+    }
+    QByteArray *pl = static_cast<DeviceMessage *>(event)->getPayload();
+    if (pl->at(0) != C2RESPONSE_TRACE)
+    {
+        return false;
+    }
+    if (!_file.isOpen())
+    {
+        // Somebody else asked. Not ours.
+        return true;
+    }
+    trace_chunk_t chunk;
+    memcpy(chunk.raw, pl->constData() + 1, sizeof(chunk));
+    double cyclesPerUs = chunk.busClockKHz / 1000.0;
+    for (uint8_t i = 0; i < chunk.count && i < TRACE_EVENTS_PER_CHUNK; i++)
+    {
+        trace_event_t *e = &chunk.events[i];
+        _events++;
+        if (e->type == TRACE_TIME_MARK)
+        {
+            // Wall clock after a quiet spell, cycle counter may have wrapped any number of times.
+            // Event right after the mark happened at the same time.
+            _time = (uint64_t)e->timestamp * chunk.busClockKHz;
+            _resync = true;
+            _stream << _time << "," << QString::number(_time / cyclesPerUs, 'f', 2) << ",time mark,0,"
+                    << e->timestamp << "\n";
+            continue;
+        }
+        // 32-bit cycle counter wraps in under a minute - between marks events are closer than that,
+        // so unwrapping is just summing deltas.
+        if (_events > 1 && !_resync)
+        {
+            _time += (uint32_t)(e->timestamp - _lastTimestamp);
+        }
+        _resync = false;
+        _lastTimestamp = e->timestamp;
+        const char *name = e->type < sizeof(traceEventNames) / sizeof(traceEventNames[0]) ? traceEventNames[e->type] : "unknown";
+        _stream << _time << "," << QString::number(_time / cyclesPerUs, 'f', 2) << "," << name << ","
+                << (int)e->arg8 << "," << e->arg16 << "\n";
+    }
+    if (chunk.count == TRACE_EVENTS_PER_CHUNK)
+    {
+        _sendTraceCommand(TRACE_DOWNLOAD, chunk.chunk + 1);
+    }
+    else
+    {
+        _file.close();
+        qInfo() << "Trace saved:" << _events << "events. Recorder is frozen until armed again.";
+    }
+    return true;
+}
@@ -0,0 +1,47 @@
+/*
+ *
+ * Copyright (C) 2017 DMA <dma@ya.ru>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+*/
+#pragma once
+
+#include <QObject>
+#include <QFile>
+#include <QTextStream>
+
+#include "../c2/c2_protocol.h"
+
+/*
+ * Downloads firmware event trace chunk by chunk and writes it out as CSV timeline.
+ */
+class FlightRecorder : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit FlightRecorder(QObject *parent = 0);
+
+public slots:
+    void arm(void);
+    void freeze(void);
+    void download(void);
+
+signals:
+    void sendCommand(OUT_c2packet_t);
+
+protected:
+    bool eventFilter(QObject *obj, QEvent *event);
+
+private:
+    QFile _file;
+    QTextStream _stream;
+    uint64_t _time;
+    uint32_t _lastTimestamp;
+    uint32_t _events;
+    bool _resync;
+
+    void _sendTraceCommand(traceCommand cmd, uint16_t chunk);
+};
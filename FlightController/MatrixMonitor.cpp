@@ -1,4 +1,5 @@
 #include <stdint.h>
+#include <climits>
 #include <algorithm>
 
 #include <QLCDNumber>
@@ -23,9 +24,11 @@ MatrixMonitor::MatrixMonitor(QWidget *parent) :
 {
     ui->setupUi(this);
 
+    memset(_frameValid, 0, sizeof(_frameValid));
     initDisplay();
     DeviceInterface &di = Singleton<DeviceInterface>::instance();
     connect(this, SIGNAL(sendCommand(c2command, uint8_t)), &di, SLOT(sendCommand(c2command, uint8_t)));
+    connect(this, SIGNAL(sendCommand(OUT_c2packet_t)), &di, SLOT(sendCommand(OUT_c2packet_t)));
     di.installEventFilter(this);
     deviceConfig = di.config;
 }
@@ -105,75 +108,157 @@ void MatrixMonitor::updateDisplaySize(uint8_t rows, uint8_t cols)
 }
 
 bool MatrixMonitor::eventFilter(QObject *obj __attribute__((unused)), QEvent *event){
-    if (event->type() == DeviceMessage::ET )
+    if (event->type() != DeviceMessage::ET)
+        return false;
+    QByteArray *pl = static_cast<DeviceMessage *>(event)->getPayload();
+    switch (pl->at(0))
     {
-        QByteArray *pl = static_cast<DeviceMessage *>(event)->getPayload();
-        if (pl->at(0) != C2RESPONSE_MATRIX_ROW)
-            return false;
-        if (_warmupRows > 0)
+        case C2RESPONSE_MATRIX_ROW:
         {
-            _warmupRows--;
+            // Old firmware - row per packet, 8 bits.
+            uint8_t row = pl->at(1);
+            uint8_t max_cols = std::min((uint8_t)pl->at(2), (uint8_t)ABSOLUTE_MAX_COLS);
+            uint16_t levels[ABSOLUTE_MAX_COLS];
+            for (uint8_t i = 0; i<max_cols; i++)
+                levels[i] = (uint8_t)pl->constData()[3+i];
+            _receiveRow(row, max_cols, levels);
             return true;
         }
-        uint8_t row = pl->at(1);
-        uint8_t max_cols = pl->at(2);
-        for (uint8_t i = 0; i<max_cols; i++) {
-            QLCDNumber *cell = display[row][i];
-            uint8_t level = pl->constData()[3+i];
-            if ((deviceConfig->deadBandHi[row][i] == 0)
-             || (!deviceConfig->bNormallyLow && level < deviceConfig->deadBandLo[row][i])
-             || (deviceConfig->bNormallyLow && level > deviceConfig->deadBandHi[row][i])
-            )
-            {
-                cell->setStyleSheet("background-color: #ffffff;");
-            }
-            else
-            {
-                cell->setStyleSheet("background-color: #00ff00;");
-            }
-            switch (filter)
+        case C2RESPONSE_MATRIX_FRAME:
+            _receiveFrame(pl);
+            return true;
+        default:
+            return false;
+    }
+}
+
+void MatrixMonitor::_receiveFrame(QByteArray *pl)
+{
+    matrix_frame_header_t header;
+    memcpy(&header, pl->constData() + 1, sizeof(header));
+    const uint8_t *ptr = (const uint8_t *)pl->constData() + 1 + sizeof(header);
+    const uint8_t *end = ptr + MATRIX_FRAME_DATA_SIZE;
+    bool delta = header.flags & (1 << MSF_DELTA);
+    uint8_t cols = std::min(header.cols, (uint8_t)ABSOLUTE_MAX_COLS);
+    for (uint8_t row = header.firstRow; row < header.firstRow + header.rows && row < ABSOLUTE_MAX_ROWS; row++)
+    {
+        uint16_t levels[ABSOLUTE_MAX_COLS];
+        if (delta)
+        {
+            for (uint8_t col = 0; col < cols; col++)
             {
-                case FilterLowPass:
-                    if (level > deviceConfig->deadBandLo[row][i])
-                        continue;
-                    break;
-                case FilterHighPass:
-                    if (level < deviceConfig->deadBandHi[row][i])
-                        continue;
-                    break;
-                default:
-                    // No error to have no filter selected.
-                    break;
+                uint16_t zigzag = 0;
+                for (uint8_t shift = 0; ptr < end; shift += 7)
+                {
+                    zigzag |= (*ptr & 0x7f) << shift;
+                    if ((*ptr++ & 0x80) == 0)
+                        break;
+                }
+                int16_t diff = (zigzag >> 1) ^ -(int16_t)(zigzag & 1);
+                levels[col] = _frame[row][col] + diff;
             }
-            _updateStatCell(row, i, level);
-            switch (displayMode)
+        }
+        else
+        {
+            uint32_t bits = 0;
+            uint8_t bitCount = 0;
+            for (uint8_t col = 0; col < cols; col++)
             {
-                case DisplayNow:
-                    cell->display(cells[row][i].now);
-                    break;
-                case DisplayMin:
-                    cell->display(cells[row][i].min);
-                    break;
-                case DisplayMax:
-                    cell->display(cells[row][i].max);
-                    break;
-                case DisplayAvg:
-                    cell->display((uint8_t)(cells[row][i].sum / cells[row][i].sampleCount));
-                    break;
-                default:
-                    qCritical() << "Unknown display mode selected!!";
-                    close();
+                while (bitCount < MATRIX_FRAME_VALUE_BITS && ptr < end)
+                {
+                    bits |= (uint32_t)*ptr++ << bitCount;
+                    bitCount += 8;
+                }
+                levels[col] = bits & ((1 << MATRIX_FRAME_VALUE_BITS) - 1);
+                bits >>= MATRIX_FRAME_VALUE_BITS;
+                bitCount -= MATRIX_FRAME_VALUE_BITS;
             }
         }
-        return true;
+        // Delta against a frame we never saw is garbage - wait for keyframe.
+        bool valid = !delta || (_frameValid[row] && (uint16_t)(_frameSequence[row] + 1) == header.sequence);
+        memcpy(_frame[row], levels, sizeof(levels));
+        _frameSequence[row] = header.sequence;
+        _frameValid[row] = valid;
+        if (valid)
+            _receiveRow(row, cols, levels);
+    }
+}
+
+void MatrixMonitor::_receiveRow(uint8_t row, uint8_t max_cols, const uint16_t *levels)
+{
+    if (_warmupRows > 0)
+    {
+        _warmupRows--;
+        return;
+    }
+    if (row >= ABSOLUTE_MAX_ROWS)
+        return;
+    for (uint8_t i = 0; i<max_cols; i++) {
+        QLCDNumber *cell = display[row][i];
+        uint16_t level = levels[i];
+        if ((deviceConfig->deadBandHi[row][i] == 0)
+         || (!deviceConfig->bNormallyLow && level < deviceConfig->deadBandLo[row][i])
+         || (deviceConfig->bNormallyLow && level > deviceConfig->deadBandHi[row][i])
+        )
+        {
+            cell->setStyleSheet("background-color: #ffffff;");
+        }
+        else
+        {
+            cell->setStyleSheet("background-color: #00ff00;");
+        }
+        switch (filter)
+        {
+            case FilterLowPass:
+                if (level > deviceConfig->deadBandLo[row][i])
+                    continue;
+                break;
+            case FilterHighPass:
+                if (level < deviceConfig->deadBandHi[row][i])
+                    continue;
+                break;
+            default:
+                // No error to have no filter selected.
+                break;
+        }
+        _updateStatCell(row, i, level);
+        switch (displayMode)
+        {
+            case DisplayNow:
+                cell->display(cells[row][i].now);
+                break;
+            case DisplayMin:
+                cell->display(cells[row][i].min);
+                break;
+            case DisplayMax:
+                cell->display(cells[row][i].max);
+                break;
+            case DisplayAvg:
+                cell->display((int)(cells[row][i].sum / cells[row][i].sampleCount));
+                break;
+            default:
+                qCritical() << "Unknown display mode selected!!";
+                close();
+        }
     }
-    return false;
 }
 
 void MatrixMonitor::enableTelemetry(uint8_t m)
 {
     ui->runButton->setText(m ? "Stop!": "Start!");
-    emit sendCommand(C2CMD_GET_MATRIX_STATE, m);
+    if (m)
+    {
+        // Refresh die temperature, it goes to the export.
+        emit sendCommand(C2CMD_GET_STATUS, 0);
+        memset(_frameValid, 0, sizeof(_frameValid));
+    }
+    OUT_c2packet_t packet;
+    memset(packet.raw, 0, sizeof(packet));
+    packet.command = C2CMD_MATRIX_STREAM;
+    packet.payload[0] = m;
+    packet.payload[1] = ui->decimationBox->value();
+    packet.payload[2] = (1 << MSF_DELTA);
+    emit sendCommand(packet);
 }
 
 void MatrixMonitor::on_runButton_clicked()
@@ -192,7 +277,7 @@ void MatrixMonitor::on_loButton_clicked()
     {
         for (uint8_t j = 0; j<deviceConfig->numCols; j++)
         {
-            deviceConfig->deadBandLo[i][j] = display[i][j]->intValue();
+            deviceConfig->deadBandLo[i][j] = std::min(display[i][j]->intValue(), UINT8_MAX);
         }
     }
 }
@@ -204,7 +289,7 @@ void MatrixMonitor::on_hiButton_clicked()
     {
         for (uint8_t j = 0; j<deviceConfig->numCols; j++)
         {
-            deviceConfig->deadBandHi[i][j] = display[i][j]->intValue();
+            deviceConfig->deadBandHi[i][j] = std::min(display[i][j]->intValue(), UINT8_MAX);
         }
     }
 }
@@ -240,7 +325,7 @@ void MatrixMonitor::_resetCells()
     {
         for (uint8_t j = 0; j<ABSOLUTE_MAX_COLS; j++)
         {
-            cells[i][j] = {.now = 0, .min = 255, .max = 0, .sum = 0, .sampleCount = 0};
+            cells[i][j] = {.now = 0, .min = UINT16_MAX, .max = 0, .sum = 0, .sampleCount = 0};
             _updateStatCellDisplay(i, j);
             display[i][j]->display(0);
         }
@@ -248,7 +333,7 @@ void MatrixMonitor::_resetCells()
     _warmupRows = ABSOLUTE_MAX_ROWS; // Workaround - stale data may come in couple of first rows.
 }
 
-void MatrixMonitor::_updateStatCell(uint8_t row, uint8_t col, uint8_t level)
+void MatrixMonitor::_updateStatCell(uint8_t row, uint8_t col, uint16_t level)
 {
     cells[row][col].now = level;
     cells[row][col].min = std::min(level, cells[row][col].min);
@@ -298,8 +383,9 @@ void MatrixMonitor::on_exportButton_clicked(void)
         QFile f(fns.at(0));
         f.open(QIODevice::WriteOnly);
         QTextStream ts (&f);
-        ts << "Row,Col,Min,Max,Avg,Sum,Count\n";
+        ts << "Row,Col,Min,Max,Avg,Sum,Count,Temp\n";
         ts.setIntegerBase(10);
+        int dieTemperature = Singleton<DeviceInterface>::instance().dieTemperature;
         for (uint8_t i = 0; i<deviceConfig->numRows; i++)
         {
             QByteArray buf;
@@ -311,10 +397,159 @@ void MatrixMonitor::on_exportButton_clicked(void)
                     ts << cells[i][j].sum/cells[i][j].sampleCount << ",";
                 else
                     ts << "0,";
-                ts << cells[i][j].sum << "," << cells[i][j].sampleCount << "\n";
+                ts << cells[i][j].sum << "," << cells[i][j].sampleCount << "," << dieTemperature << "\n";
             }
         }
         f.close();
     }
 
 }
+
+/**
+ * Reads average levels from a file produced by the export button.
+ */
+bool MatrixMonitor::_readStats(QString fileName, double levels[ABSOLUTE_MAX_ROWS][ABSOLUTE_MAX_COLS], int *temperature)
+{
+    QFile f(fileName);
+    if (!f.open(QIODevice::ReadOnly))
+    {
+        qWarning() << "Cannot open" << fileName;
+        return false;
+    }
+    QTextStream ts(&f);
+    ts.readLine(); // Header
+    while (!ts.atEnd())
+    {
+        QStringList fields = ts.readLine().split(",");
+        if (fields.size() < 7)
+            continue;
+        uint8_t row = fields[0].toUInt();
+        uint8_t col = fields[1].toUInt();
+        if (row >= ABSOLUTE_MAX_ROWS || col >= ABSOLUTE_MAX_COLS)
+            continue;
+        double count = fields[6].toDouble();
+        levels[row][col] = (count > 0) ? fields[5].toDouble() / count : 0;
+        if (temperature && fields.size() > 7)
+            *temperature = fields[7].toInt();
+    }
+    f.close();
+    return true;
+}
+
+/**
+ * Learns how much one key leaks into its neighbours.
+ * Takes two exported recordings - no keys pressed and exactly one key held.
+ * The held key is the one which moved most. Coefficient is neighbour's shift
+ * relative to held key's threshold span, because that's what firmware sees as aggressor excursion.
+ * Repeat for every key that needs it - previous entries for the same aggressor are replaced.
+ */
+void MatrixMonitor::on_crosstalkButton_clicked(void)
+{
+    if (!deviceConfig->bValid) return;
+    QSettings settings;
+    QString idleFile = QFileDialog::getOpenFileName(this, "Recording with no keys pressed",
+            settings.value(SETTINGS_DIR_KEY).toString(), tr("Matrix stats(*.csv)"));
+    if (idleFile.isEmpty()) return;
+    QString heldFile = QFileDialog::getOpenFileName(this, "Recording with one key held",
+            QFileInfo(idleFile).canonicalPath(), tr("Matrix stats(*.csv)"));
+    if (heldFile.isEmpty()) return;
+    double idle[ABSOLUTE_MAX_ROWS][ABSOLUTE_MAX_COLS] = {};
+    double held[ABSOLUTE_MAX_ROWS][ABSOLUTE_MAX_COLS] = {};
+    if (!_readStats(idleFile, idle, NULL) || !_readStats(heldFile, held, NULL)) return;
+
+    // Pressing moves normally-low switches up and beamsprings down.
+    double direction = deviceConfig->bNormallyLow ? 1.0 : -1.0;
+    uint8_t aRow = 0, aCol = 0;
+    double aShift = 0;
+    for (uint8_t i = 0; i < deviceConfig->numRows; i++)
+    {
+        for (uint8_t j = 0; j < deviceConfig->numCols; j++)
+        {
+            double shift = direction * (held[i][j] - idle[i][j]);
+            if (shift > aShift)
+            {
+                aShift = shift;
+                aRow = i;
+                aCol = j;
+            }
+        }
+    }
+    if (aShift <= 0)
+    {
+        QMessageBox::critical(this, "Error", "No key seems to be held in the second recording");
+        return;
+    }
+    int span = deviceConfig->deadBandHi[aRow][aCol] - deviceConfig->deadBandLo[aRow][aCol];
+    double aExcursion = (span > 0) ? span : aShift;
+    uint8_t aggressor = aRow * deviceConfig->numCols + aCol;
+
+    std::vector<crosstalk_entry_t> table = deviceConfig->crosstalk();
+    table.erase(std::remove_if(table.begin(), table.end(),
+                [aggressor](const crosstalk_entry_t &e) { return e.aggressor == aggressor; }), table.end());
+    for (int i = aRow - 1; i <= aRow + 1; i++)
+    {
+        for (int j = aCol - 1; j <= aCol + 1; j++)
+        {
+            if (i < 0 || j < 0 || i >= deviceConfig->numRows || j >= deviceConfig->numCols || (i == aRow && j == aCol))
+                continue;
+            int coefficient = qRound(256 * direction * (held[i][j] - idle[i][j]) / aExcursion);
+            if (coefficient <= 0)
+                continue;
+            crosstalk_entry_t e;
+            e.victim = i * deviceConfig->numCols + j;
+            e.aggressor = aggressor;
+            e.coefficient = std::min(coefficient, 255);
+            table.push_back(e);
+            qInfo().nospace() << "Key " << aRow+1 << ":" << aCol+1 << " leaks "
+                              << (int)e.coefficient << "/256 into " << i+1 << ":" << j+1;
+        }
+    }
+    deviceConfig->setCrosstalk(table);
+    settings.setValue(SETTINGS_DIR_KEY, QFileInfo(idleFile).canonicalPath());
+}
+
+/**
+ * Learns how levels drift with die temperature.
+ * Takes two exported idle recordings made at different temperatures (older exports have no temperature - won't do).
+ * First one should be made at the temperature thresholds were set at - it becomes the reference.
+ * Slope is average shift of all sensed keys per degree, in 1/16 units.
+ */
+void MatrixMonitor::on_temperatureButton_clicked(void)
+{
+    if (!deviceConfig->bValid) return;
+    QSettings settings;
+    QString refFile = QFileDialog::getOpenFileName(this, "Idle recording at calibration temperature",
+            settings.value(SETTINGS_DIR_KEY).toString(), tr("Matrix stats(*.csv)"));
+    if (refFile.isEmpty()) return;
+    QString otherFile = QFileDialog::getOpenFileName(this, "Idle recording at another temperature",
+            QFileInfo(refFile).canonicalPath(), tr("Matrix stats(*.csv)"));
+    if (otherFile.isEmpty()) return;
+    double ref[ABSOLUTE_MAX_ROWS][ABSOLUTE_MAX_COLS] = {};
+    double other[ABSOLUTE_MAX_ROWS][ABSOLUTE_MAX_COLS] = {};
+    int refTemperature = INT_MIN, otherTemperature = INT_MIN;
+    if (!_readStats(refFile, ref, &refTemperature) || !_readStats(otherFile, other, &otherTemperature)) return;
+    if (refTemperature == INT_MIN || otherTemperature == INT_MIN || refTemperature == otherTemperature)
+    {
+        QMessageBox::critical(this, "Error", "Recordings must carry different die temperatures");
+        return;
+    }
+    double shift = 0;
+    int keys = 0;
+    for (uint8_t i = 0; i < deviceConfig->numRows; i++)
+    {
+        for (uint8_t j = 0; j < deviceConfig->numCols; j++)
+        {
+            if (deviceConfig->deadBandHi[i][j] == 0 || deviceConfig->skipSensing[i][j])
+                continue;
+            shift += other[i][j] - ref[i][j];
+            keys++;
+        }
+    }
+    if (keys == 0) return;
+    int slope = qRound(16 * shift / keys / (otherTemperature - refTemperature));
+    slope = std::max(INT8_MIN, std::min(INT8_MAX, slope));
+    deviceConfig->setTemperatureCompensation(refTemperature, slope);
+    deviceConfig->bTemperatureCompensation = true;
+    qInfo().nospace() << "Levels drift " << slope << "/16 per degree C from " << refTemperature << "C";
+    settings.setValue(SETTINGS_DIR_KEY, QFileInfo(refFile).canonicalPath());
+}
@@ -14,9 +14,9 @@ class MatrixMonitor;
 }
 
 typedef struct {
-    uint8_t now;
-    uint8_t min;
-    uint8_t max;
+    uint16_t now;
+    uint16_t min;
+    uint16_t max;
     uint32_t sum;
     uint32_t sampleCount;
 } MonitoredCell;
@@ -36,6 +36,7 @@ public:
 
 signals:
     void sendCommand(c2command, uint8_t);
+    void sendCommand(OUT_c2packet_t);
 
 protected:
     bool eventFilter(QObject *obj, QEvent *event);
@@ -52,14 +53,21 @@ private:
     QLabel *statsDisplay[ABSOLUTE_MAX_ROWS][ABSOLUTE_MAX_COLS];
     DeviceConfig *deviceConfig;
     uint8_t _warmupRows;
+    // Last decoded stream frame - base for deltas.
+    uint16_t _frame[ABSOLUTE_MAX_ROWS][ABSOLUTE_MAX_COLS];
+    uint16_t _frameSequence[ABSOLUTE_MAX_ROWS];
+    bool _frameValid[ABSOLUTE_MAX_ROWS];
 
 
     void initDisplay(void);
     void updateDisplaySize(uint8_t, uint8_t);
     void enableTelemetry(uint8_t);
     void _resetCells();
-    void _updateStatCell(uint8_t row, uint8_t col, uint8_t level);
+    void _receiveFrame(QByteArray *pl);
+    void _receiveRow(uint8_t row, uint8_t max_cols, const uint16_t *levels);
+    void _updateStatCell(uint8_t row, uint8_t col, uint16_t level);
     void _updateStatCellDisplay(uint8_t row, uint8_t col);
+    bool _readStats(QString fileName, double levels[ABSOLUTE_MAX_ROWS][ABSOLUTE_MAX_COLS], int *temperature);
 
 private slots:
     void on_runButton_clicked(void);
@@ -70,5 +78,7 @@ private slots:
     void on_resetButton_clicked(void);
     void on_filterBox_currentTextChanged(QString newValue);
     void on_exportButton_clicked(void);
+    void on_crosstalkButton_clicked(void);
+    void on_temperatureButton_clicked(void);
 
 };
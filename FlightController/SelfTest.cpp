@@ -0,0 +1,234 @@
+/*
+ *
+ * Copyright (C) 2017 DMA <dma@ya.ru>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+*/
+#include <algorithm>
+#include <QDateTime>
+#include <QtMath>
+
+#include "SelfTest.h"
+#include "DeviceInterface.h"
+#include "singleton.h"
+#include "settings.h"
+#include "Events.h"
+
+// How many of the noisiest keys to list.
+#define NOISY_KEYS_SHOWN 5
+
+SelfTest::SelfTest(QObject *parent) : QObject(parent),
+    _running(false)
+{
+    DeviceInterface &di = Singleton<DeviceInterface>::instance();
+    di.installEventFilter(this);
+    connect(this, SIGNAL(sendCommand(OUT_c2packet_t)), &di, SLOT(sendCommand(OUT_c2packet_t)));
+}
+
+void SelfTest::_sendSelftestCommand(selftestCommand cmd, uint8_t arg)
+{
+    OUT_c2packet_t packet;
+    memset(packet.raw, 0, sizeof(packet));
+    packet.command = C2CMD_SELFTEST;
+    packet.payload[0] = cmd;
+    packet.payload[1] = arg;
+    emit sendCommand(packet);
+}
+
+void SelfTest::run(void)
+{
+    qInfo() << "Self-test started. Don't touch the keys until it's done.";
+    _chunks.clear();
+    _running = true;
+    _sendSelftestCommand(SELFTEST_START, SELFTEST_PASSES_DEFAULT);
+}
+
+QString SelfTest::_settingsGroup(void)
+{
+    QString serial = Singleton<DeviceInterface>::instance().serialNumber;
+    return QString(SELFTEST_KEY "/%1").arg(serial.isEmpty() ? QString("unknown") : serial);
+}
+
+void SelfTest::clearBaseline(void)
+{
+    QSettings settings;
+    settings.remove(_settingsGroup() + "/baseline");
+    qInfo() << "Self-test baseline cleared. Next run becomes the new one.";
+}
+
+bool SelfTest::_decode(const QByteArray &chunks, result_t &result)
+{
+    bool haveSummary = false;
+    result.rows.clear();
+    result.keys.clear();
+    for (int pos = 0; pos + (int)sizeof(selftest_chunk_t) <= chunks.size(); pos += sizeof(selftest_chunk_t))
+    {
+        selftest_chunk_t chunk;
+        memcpy(chunk.raw, chunks.constData() + pos, sizeof(chunk));
+        switch (chunk.type)
+        {
+        case SELFTEST_CHUNK_SUMMARY:
+            result.summary = chunk.summary;
+            haveSummary = true;
+            break;
+        case SELFTEST_CHUNK_ROWS:
+            for (uint8_t i = 0; i < chunk.count && i < SELFTEST_ROWS_PER_CHUNK; i++)
+                result.rows.append(chunk.rows[i]);
+            break;
+        case SELFTEST_CHUNK_KEYS:
+            for (uint8_t i = 0; i < chunk.count && i < SELFTEST_KEYS_PER_CHUNK; i++)
+                result.keys.append(chunk.keys[i]);
+            break;
+        default:
+            break;
+        }
+    }
+    return haveSummary && result.keys.size() == result.summary.rows * result.summary.cols;
+}
+
+static QString lineList(uint32_t mask)
+{
+    QStringList lines;
+    for (uint8_t i = 0; i < 32; i++)
+    {
+        if (mask & (1ul << i))
+            lines << QString::number(i);
+    }
+    return lines.isEmpty() ? QString("none") : lines.join(", ");
+}
+
+static double sigma(const selftest_key_t &key)
+{
+    return qSqrt(key.variance / 16.0);
+}
+
+void SelfTest::_report(const result_t &result)
+{
+    const selftest_summary_t &s = result.summary;
+    double cyclesPerUs = s.busClockKHz / 1000.0;
+    qInfo().nospace() << "Self-test: " << s.passesDone << "/" << s.passes << " passes in "
+                      << QString::number(s.durationCycles / cyclesPerUs / 1000, 'f', 1) << "ms, "
+                      << s.faults << " scan faults";
+    if (s.passesDone < s.passes)
+    {
+        qWarning() << "Self-test was interrupted, figures are partial.";
+    }
+    for (int i = 0; i < result.rows.size(); i++)
+    {
+        qInfo().nospace() << "Row " << i << ": period " << QString::number(result.rows[i].periodCycles / cyclesPerUs, 'f', 1)
+                          << "us, ISR " << result.rows[i].isrCycles << " cycles, max " << result.rows[i].isrCyclesMax;
+    }
+    qInfo().nospace() << "Median level " << QString::number(s.levelMedian / 16.0, 'f', 1) << ", "
+                      << s.saturatedKeys << " keys hit ADC rail";
+    qInfo().nospace() << "Suspect drive lines: " << lineList(s.suspectRows) << "; sense lines: " << lineList(s.suspectCols);
+    QVector<int> order(result.keys.size());
+    for (int i = 0; i < order.size(); i++)
+        order[i] = i;
+    std::sort(order.begin(), order.end(), [&result](int a, int b) {
+        return result.keys[a].variance > result.keys[b].variance;
+    });
+    QDebug noisy = qInfo().nospace();
+    noisy << "Noisiest keys (row,col sigma):";
+    for (int i = 0; i < std::min(order.size(), NOISY_KEYS_SHOWN); i++)
+    {
+        const selftest_key_t &key = result.keys[order[i]];
+        noisy << " " << order[i] / s.cols << "," << order[i] % s.cols << " " << QString::number(sigma(key), 'f', 2)
+              << " (" << key.min << ".." << key.max << ")";
+    }
+}
+
+/*
+ * Keys whose mean moved by more than quarter or whose noise doubled since baseline.
+ * Doubling from almost nothing is still almost nothing - noise under 1 count is left alone.
+ */
+void SelfTest::_compare(const result_t &result, const result_t &baseline)
+{
+    if (baseline.summary.rows != result.summary.rows || baseline.summary.cols != result.summary.cols)
+    {
+        qWarning() << "Self-test baseline is for a different matrix, not comparing.";
+        return;
+    }
+    QStringList shifted, noisier;
+    for (int i = 0; i < result.keys.size(); i++)
+    {
+        const selftest_key_t &now = result.keys[i];
+        const selftest_key_t &then = baseline.keys[i];
+        QString key = QString("%1,%2").arg(i / result.summary.cols).arg(i % result.summary.cols);
+        if (qAbs(now.mean - then.mean) * 4 > then.mean)
+            shifted << key;
+        if (sigma(now) >= 1.0 && sigma(now) > sigma(then) * 2)
+            noisier << key;
+    }
+    qInfo().nospace() << "Against baseline: median level " << QString::number(baseline.summary.levelMedian / 16.0, 'f', 1)
+                      << " -> " << QString::number(result.summary.levelMedian / 16.0, 'f', 1);
+    qInfo().nospace() << "Level shifted: " << (shifted.isEmpty() ? QString("none") : shifted.join(" "));
+    qInfo().nospace() << "Noise doubled: " << (noisier.isEmpty() ? QString("none") : noisier.join(" "));
+    uint32_t newRows = result.summary.suspectRows & ~baseline.summary.suspectRows;
+    uint32_t newCols = result.summary.suspectCols & ~baseline.summary.suspectCols;
+    if (newRows || newCols)
+    {
+        qWarning().nospace() << "New suspect lines - drive: " << lineList(newRows) << "; sense: " << lineList(newCols);
+    }
+}
+
+void SelfTest::_finish(void)
+{
+    result_t result, baseline;
+    if (!_decode(_chunks, result))
+    {
+        qWarning() << "Self-test results incomplete, not stored.";
+        return;
+    }
+    _report(result);
+    QSettings settings;
+    settings.beginGroup(_settingsGroup());
+    if (settings.contains("baseline") && _decode(settings.value("baseline").toByteArray(), baseline))
+    {
+        _compare(result, baseline);
+    }
+    else if (result.summary.passesDone == result.summary.passes)
+    {
+        settings.setValue("baseline", _chunks);
+        settings.setValue("baselineTime", QDateTime::currentDateTime());
+        qInfo() << "Stored as baseline for" << _settingsGroup();
+    }
+    settings.setValue("last", _chunks);
+    settings.setValue("lastTime", QDateTime::currentDateTime());
+    settings.endGroup();
+}
+
+bool SelfTest::eventFilter(QObject *obj __attribute__((unused)), QEvent *event)
+{
+    if (event->type() != DeviceMessage::ET)
+    {
+        return false;
+    }
+    QByteArray *pl = static_cast<DeviceMessage *>(event)->getPayload();
+    if (pl->at(0) != C2RESPONSE_SELFTEST)
+    {
+        return false;
+    }
+    if (!_running)
+    {
+        // Somebody else asked. Not ours.
+        return true;
+    }
+    selftest_chunk_t chunk;
+    memcpy(chunk.raw, pl->constData() + 1, sizeof(chunk));
+    if (chunk.type == SELFTEST_CHUNK_END)
+    {
+        if (chunk.chunk == 0)
+        {
+            // Device is still busy with another run - its summary will come.
+            return true;
+        }
+        _running = false;
+        _finish();
+        return true;
+    }
+    _chunks.append((const char *)chunk.raw, sizeof(chunk));
+    _sendSelftestCommand(SELFTEST_DOWNLOAD, chunk.chunk + 1);
+    return true;
+}
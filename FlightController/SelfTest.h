@@ -0,0 +1,54 @@
+/*
+ *
+ * Copyright (C) 2017 DMA <dma@ya.ru>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+*/
+#pragma once
+
+#include <QObject>
+#include <QByteArray>
+#include <QVector>
+
+#include "../c2/c2_protocol.h"
+
+/*
+ * Runs firmware self-test, downloads the results and logs them. Results are kept per device serial -
+ * first run becomes the baseline later runs are compared with.
+ */
+class SelfTest : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit SelfTest(QObject *parent = 0);
+
+public slots:
+    void run(void);
+    void clearBaseline(void);
+
+signals:
+    void sendCommand(OUT_c2packet_t);
+
+protected:
+    bool eventFilter(QObject *obj, QEvent *event);
+
+private:
+    typedef struct {
+        selftest_summary_t summary;
+        QVector<selftest_row_t> rows;
+        QVector<selftest_key_t> keys;
+    } result_t;
+
+    bool _running;
+    QByteArray _chunks;
+
+    void _sendSelftestCommand(selftestCommand cmd, uint8_t arg);
+    static bool _decode(const QByteArray &chunks, result_t &result);
+    QString _settingsGroup(void);
+    void _report(const result_t &result);
+    void _compare(const result_t &result, const result_t &baseline);
+    void _finish(void);
+};
@@ -1,3 +1,4 @@
+#include <QDebug>
 #include <QLabel>
 #include <QMessageBox>
 #include <QSpinBox>
@@ -127,6 +128,10 @@ void ThresholdEditor::applyThresholds()
 {
     deviceConfig->guardLo = ui->loGuardSpinbox->value();
     deviceConfig->guardHi = ui->hiGuardSpinbox->value();
+    deviceConfig->bCommonModeRejection = ui->cmrCheckbox->isChecked();
+    deviceConfig->bTemperatureCompensation = ui->tcCheckbox->isChecked();
+    deviceConfig->bAutoThrottle = ui->atCheckbox->isChecked();
+    applyHotKeys();
     for (uint8_t i = 0; i < deviceConfig->numRows; i++)
     {
         for (uint8_t j = 0; j < deviceConfig->numCols; j++)
@@ -137,10 +142,42 @@ void ThresholdEditor::applyThresholds()
     }
 }
 
+// Hot keys are "row,col" pairs, numbered like the grid.
+void ThresholdEditor::applyHotKeys()
+{
+    std::vector<uint8_t> scancodes;
+    for (const QString &key : ui->hotKeysEdit->text().split(' ', QString::SkipEmptyParts))
+    {
+        QStringList rc = key.split(',');
+        bool rowOk = false, colOk = false;
+        int row = rc.size() == 2 ? rc[0].toInt(&rowOk) : 0;
+        int col = rc.size() == 2 ? rc[1].toInt(&colOk) : 0;
+        if (!rowOk || !colOk || row < 1 || row > deviceConfig->numRows || col < 1 || col > deviceConfig->numCols)
+        {
+            qWarning() << "Bad hot key" << key << "- ignored. Use row,col as in the grid.";
+            continue;
+        }
+        scancodes.push_back((row - 1) * deviceConfig->numCols + col - 1);
+    }
+    deviceConfig->setHotKeys(scancodes, ui->hotRateSpinbox->value());
+}
+
 void ThresholdEditor::resetThresholds()
 {
     ui->loGuardSpinbox->setValue(deviceConfig->guardLo);
     ui->hiGuardSpinbox->setValue(deviceConfig->guardHi);
+    ui->cmrCheckbox->setChecked(deviceConfig->bCommonModeRejection);
+    // Nothing to compensate with until drift is learned in Key Monitor.
+    ui->tcCheckbox->setEnabled(deviceConfig->hasTemperatureCompensation());
+    ui->tcCheckbox->setChecked(deviceConfig->bTemperatureCompensation && deviceConfig->hasTemperatureCompensation());
+    ui->atCheckbox->setChecked(deviceConfig->bAutoThrottle);
+    QStringList hotKeys;
+    for (uint8_t sc : deviceConfig->hotKeys())
+    {
+        hotKeys << QString("%1,%2").arg(sc / deviceConfig->numCols + 1).arg(sc % deviceConfig->numCols + 1);
+    }
+    ui->hotKeysEdit->setText(hotKeys.join(" "));
+    ui->hotRateSpinbox->setValue(deviceConfig->hotRowRate());
     for (uint8_t i = 0; i < deviceConfig->numRows; i++)
     {
         for (uint8_t j = 0; j < deviceConfig->numCols; j++)
@@ -151,6 +188,8 @@ void ThresholdEditor::resetThresholds()
         }
     }
     qInfo() << "Loaded threshold map";
+    // Quarantined keys will be painted when report arrives.
+    Singleton<DeviceInterface>::instance().sendCommand(C2CMD_GET_HEALTH, (uint8_t)0);
 }
 
 void ThresholdEditor::receiveScancode(uint8_t row, uint8_t col, DeviceInterface::KeyStatus status)
@@ -165,6 +204,12 @@ void ThresholdEditor::receiveScancode(uint8_t row, uint8_t col, DeviceInterface:
     }
 }
 
+void ThresholdEditor::receiveQuarantine(uint8_t row, uint8_t col)
+{
+    display[row][col]->setStyleSheet("background-color: #ff8080;");
+    display[row][col]->setToolTip("Quarantined by firmware - too many events or stuck");
+}
+
 void ThresholdEditor::on_closeButton_clicked()
 {
     this->close();
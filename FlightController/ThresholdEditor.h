@@ -27,6 +27,7 @@ public slots:
     void updateLows(void);
     void updateHighs(void);
     void receiveScancode(uint8_t row, uint8_t col, DeviceInterface::KeyStatus status);
+    void receiveQuarantine(uint8_t row, uint8_t col);
 
 private:
     Ui::ThresholdEditor *ui;
@@ -38,6 +39,7 @@ private:
     DeviceConfig *deviceConfig;
     void initDisplay();
     void updateDisplaySize(uint8_t, uint8_t);
+    void applyHotKeys(void);
 
 private slots:
     void on_closeButton_clicked(void);
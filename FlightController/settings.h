@@ -9,4 +9,7 @@
 
 #define FIRMWARE_FILE_KEY "firmware_file"
 
+// Self-test results, grouped by device serial.
+#define SELFTEST_KEY "selftest"
+
 #endif // SETTINGS_H
@@ -10,6 +10,7 @@
 #pragma once
 
 #include <stdint.h>
+#include "log_messages.h"
 #define ABSOLUTE_MAX_ROWS 16
 #define ABSOLUTE_MAX_COLS 32
 #define ABSOLUTE_MAX_LAYERS 8
@@ -46,18 +47,41 @@ enum c2command {
     // Bootloader command must keep it's place or you lose firmware update capability.
     C2CMD_UPLOAD_CONFIG, // FROM host
     C2CMD_DOWNLOAD_CONFIG, // TO host
-    C2CMD_APPLY_CONFIG, // reinits sensitive parts
+    C2CMD_APPLY_CONFIG, // reinits sensitive parts. payload[0] - CONFIG_APPLY_CHECKED, [1..2] - image CRC host verified
     C2CMD_COMMIT,
     C2CMD_ROLLBACK,
     C2CMD_SET_MODE,
-    C2CMD_GET_MATRIX_STATE
+    C2CMD_GET_MATRIX_STATE,
+    C2CMD_GET_HEALTH, // payload[0] != 0 releases quarantined keys
+    C2CMD_GET_PERF, // payload[0] != 0 resets counters after reporting
+    C2CMD_TRACE, // payload[0] - traceCommand, payload[1-2] - chunk number (LE) for TRACE_DOWNLOAD
+    C2CMD_MATRIX_STREAM, // payload[0] - enable, [1] - send every Nth frame, [2] - matrixStreamFlags
+    C2CMD_UPLOAD_CONFIG_V2, // payload[0] - block, [1..] - data. Acked by C2RESPONSE_CONFIG_V2 with block number only.
+    C2CMD_DOWNLOAD_CONFIG_V2, // payload[0] - block
+    C2CMD_CONFIG_CRC, // payload[0] - configRegion. CRC of the whole image as device has it now
+    C2CMD_CONFIG_HASHES, // payload[0] - first block to report, [1] - configRegion
+    C2CMD_UPLOAD_EXT_CONFIG, // payload[0] - block, [1..] - EXT_CONFIG_BLOCK_SIZE bytes of data. Acked by C2RESPONSE_EXT_CONFIG with block number only.
+    C2CMD_DOWNLOAD_EXT_CONFIG, // payload[0] - block
+    C2CMD_SELFTEST, // payload[0] - selftestCommand, [1] - passes for SELFTEST_START, chunk for SELFTEST_DOWNLOAD
 };
 
 enum c2response {
     C2RESPONSE_STATUS = 0x00,
     C2RESPONSE_CONFIG,
     C2RESPONSE_SCANCODE,
-    C2RESPONSE_MATRIX_ROW
+    C2RESPONSE_MATRIX_ROW,
+    C2RESPONSE_HEALTH, // [rows][cols][quarantine bitmap, 4 bytes LE per row]
+    C2RESPONSE_PERF, // perf_counters_t
+    C2RESPONSE_TRACE, // trace_chunk_t
+    C2RESPONSE_LOG, // [count]{[logMessage][argc][argc * int32_t LE]}
+    C2RESPONSE_MATRIX_FRAME, // matrix_frame_header_t, then row data
+    C2RESPONSE_CONFIG_V2, // [block][data]
+    C2RESPONSE_CONFIG_CRC, // [crc16 LE]
+    C2RESPONSE_CONFIG_HASHES, // [first block][count][count * crc16 LE]
+    C2RESPONSE_EXT_CONFIG, // [block][data]
+    C2RESPONSE_POWER, // power_counters_t, follows C2RESPONSE_PERF
+    C2RESPONSE_SCAN_INTEGRITY, // scan_integrity_t, follows C2RESPONSE_POWER
+    C2RESPONSE_SELFTEST, // selftest_chunk_t
 };
 
 enum deviceStatus {
@@ -69,6 +93,13 @@ enum deviceStatus {
 enum capsenseFlags {
     CSF_OE = 0,
     CSF_NL = 1,
+    CSF_CMR = 2, // Common mode rejection
+    CSF_TC = 3, // Temperature compensation
+    CSF_AT = 4, // Auto-throttle scan on ISR overruns
+};
+
+enum matrixStreamFlags {
+    MSF_DELTA = 0, // Send changes against previous frame, with periodic keyframes.
 };
 
 enum deviceMode {
@@ -100,6 +131,230 @@ typedef union {
     uint8_t raw[4];
 } device_status_t;
 
+/*
+ * Scan rate governor. Rate 0 is free-running scan, others start one pass every SCAN_RATE_PERIODS[i] ms.
+ * Governor steps one rate down per scanGovernorIdle of quiet matrix and goes back to 0 on the first sign of activity.
+ */
+#define SCAN_RATES 4
+#define SCAN_RATE_PERIODS {0, 1, 4, 16}
+
+/*
+ * Firmware performance counters. Cycle counts are CPU cycles (DWT), busClockKHz converts them to time.
+ * Everything except scanPassesPerSecond and usbQueueOccupancy accumulates since boot or last reset.
+ */
+typedef union {
+    struct {
+        uint32_t uptime; // ms
+        uint32_t busClockKHz;
+        uint16_t scanPassesPerSecond;
+        uint32_t isrCyclesMax;
+        uint64_t isrCyclesTotal;
+        uint32_t isrRuns;
+        uint8_t scancodeHighWater;
+        uint16_t scancodeDrops;
+        uint8_t usbQueueOccupancy;
+        uint8_t usbQueueHighWater;
+        uint16_t reportsCollapsed; // HID reports replaced by newer state before host polled
+        uint16_t c2Drops; // control packets dropped on full transmit queue
+        // Named after firmware endpoint prefixes - USB_SEND_REPORT pastes them.
+        uint32_t reportsKBD;
+        uint32_t reportsCONSUMER;
+        uint32_t reportsSYSTEM;
+        uint32_t reportsC2;
+        uint16_t logDrops;
+        uint8_t scanRate; // current scan rate index, see SCAN_RATES
+        uint16_t scanRateResidency[SCAN_RATES]; // seconds spent at each scan rate
+    } __attribute__ ((packed));
+    uint8_t raw[62];
+} perf_counters_t;
+
+/*
+ * Suspend/resume timings. Reported and reset by C2CMD_GET_PERF together with perf_counters_t.
+ */
+typedef union {
+    struct {
+        uint16_t suspends;
+        uint16_t hostResumes;
+        uint16_t remoteWakeups;
+        uint32_t lastSuspendMs; // how long last suspend lasted
+        uint32_t resumeUsLast; // resume signalling detected to scan running
+        uint32_t resumeUsMax;
+        uint16_t wakeupSignalMs; // remote wakeup - wake key to end of resume signalling
+        uint16_t firstKeyMs; // resume to first key event, 0xffff - none since last resume
+    } __attribute__ ((packed));
+    uint8_t raw[22];
+} power_counters_t;
+
+/*
+ * Scan pass integrity. EoC_ISR tags every row it hands to Result_ISR, faults are rows
+ * Result_ISR couldn't keep up with. Reported and reset by C2CMD_GET_PERF, after power_counters_t.
+ */
+enum scanFaults {
+    SCAN_FAULT_OVERRUN = 0x01, // Result_ISR still busy when next conversion ended
+    SCAN_FAULT_DEFERRED = 0x02, // EoC_ISR held a transfer - previous row not processed yet
+    SCAN_FAULT_SKIPPED = 0x04, // Result_ISR saw a gap in transfer tags
+};
+
+typedef union {
+    struct {
+        uint32_t rowTransfers;
+        uint16_t isrOverruns;
+        uint16_t transfersDeferred;
+        uint16_t rowsSkipped;
+        uint16_t passesFaulted; // scan passes with any fault
+        uint32_t lastFaultMs; // systime of last fault, 0 - none
+        uint8_t slack; // auto-throttle: extra conversions each row is held for
+        uint8_t slackMax; // highest slack since reset
+    } __attribute__ ((packed));
+    uint8_t raw[18];
+} scan_integrity_t;
+
+/*
+ * Flight recorder. Firmware keeps last TRACE_BUFFER_SIZE events, host downloads them
+ * TRACE_EVENTS_PER_CHUNK at a time, oldest first. Chunk with count < TRACE_EVENTS_PER_CHUNK is the last one.
+ * Downloading freezes the recorder, TRACE_ARM clears it and starts over.
+ */
+enum traceCommand {
+    TRACE_ARM = 0,
+    TRACE_FREEZE,
+    TRACE_DOWNLOAD,
+};
+
+enum traceEventType {
+    TRACE_NONE = 0,
+    TRACE_SCAN_PASS, // arg8 - back to back passes folded in, timestamp and arg16 (pass number within second) are of the last
+    TRACE_SCANCODE, // arg8 - scancode generated by Result_ISR, arg16 - 1 if dropped on full buffer
+    TRACE_KEY, // arg8 - scancode picked up by process_real_key
+    TRACE_QUEUE, // arg8 - USB keycode, arg16 - flags
+    TRACE_REPORT, // arg8 - endpoint
+    TRACE_POWER_STATE, // arg8 - devicePowerStates
+    TRACE_CONFIG_APPLY,
+    TRACE_SCAN_RATE, // arg8 - scan rate index, 0 is full
+    TRACE_SCAN_FAULT, // arg8 - row, arg16 - scanFaults
+    TRACE_TIME_MARK, // timestamp is systime in ms, not cycles. Precedes first event after a quiet spell.
+};
+
+static const char * const traceEventNames[] = {
+    "none",
+    "scan pass",
+    "scancode",
+    "key",
+    "queue",
+    "report",
+    "power state",
+    "config apply",
+    "scan rate",
+    "scan fault",
+    "time mark",
+};
+
+typedef struct {
+    uint32_t timestamp; // CPU cycles (DWT)
+    uint8_t type;
+    uint8_t arg8;
+    uint16_t arg16;
+} __attribute__ ((packed)) trace_event_t;
+
+#define TRACE_EVENTS_PER_CHUNK 7
+
+typedef union {
+    struct {
+        uint16_t chunk;
+        uint8_t count;
+        uint32_t busClockKHz;
+        trace_event_t events[TRACE_EVENTS_PER_CHUNK];
+    } __attribute__ ((packed));
+    uint8_t raw[63];
+} trace_chunk_t;
+
+/*
+ * Self-test. SELFTEST_START runs that many whole passes at full rate in plain row order, sampling raw readouts.
+ * Device sends chunk 0 (summary) when done, host then downloads the rest chunk by chunk until SELFTEST_CHUNK_END.
+ * Noise figures assume nobody touches the keys meanwhile.
+ */
+enum selftestCommand {
+    SELFTEST_START = 0,
+    SELFTEST_DOWNLOAD,
+};
+
+enum selftestChunkType {
+    SELFTEST_CHUNK_SUMMARY = 0,
+    SELFTEST_CHUNK_ROWS, // selftest_row_t, by row - or by slot in code-division mode
+    SELFTEST_CHUNK_KEYS, // selftest_key_t, by scancode
+    SELFTEST_CHUNK_END,
+};
+
+#define SELFTEST_PASSES_DEFAULT 64
+
+typedef struct {
+    uint8_t passes;
+    uint8_t passesDone; // fewer than passes - interrupted by suspend
+    uint8_t rows;
+    uint8_t cols;
+    uint8_t adcResolution;
+    uint32_t busClockKHz;
+    uint32_t durationCycles;
+    uint16_t faults; // scan integrity faults while running
+    uint16_t saturatedKeys; // keys with any sample at ADC rail
+    uint16_t levelMedian; // median row level, 1/16 counts
+    uint32_t suspectRows; // drive lines - level under half or over twice the median, or all keys saturated
+    uint32_t suspectCols; // sense lines, same
+} __attribute__ ((packed)) selftest_summary_t;
+
+typedef struct {
+    uint32_t periodCycles; // average, readout to readout of the previous row
+    uint16_t isrCycles; // average Result_ISR cost
+    uint16_t isrCyclesMax;
+} __attribute__ ((packed)) selftest_row_t;
+
+typedef struct {
+    uint16_t min;
+    uint16_t max;
+    uint16_t mean; // 1/16 counts
+    uint16_t variance; // 1/16 counts squared, clamped
+    uint8_t saturated; // samples at ADC rail
+} __attribute__ ((packed)) selftest_key_t;
+
+#define SELFTEST_ROWS_PER_CHUNK 7
+#define SELFTEST_KEYS_PER_CHUNK 6
+
+typedef union {
+    struct {
+        uint8_t chunk;
+        uint8_t type; // selftestChunkType
+        uint8_t first; // row or scancode of first entry
+        uint8_t count;
+        union {
+            selftest_summary_t summary;
+            selftest_row_t rows[SELFTEST_ROWS_PER_CHUNK];
+            selftest_key_t keys[SELFTEST_KEYS_PER_CHUNK];
+        };
+    } __attribute__ ((packed));
+    uint8_t raw[63];
+} selftest_chunk_t;
+
+/*
+ * Matrix telemetry stream. Frame is one full matrix snapshot, split into as many packets as needed.
+ * Every packet carries whole rows, firstRow to firstRow + rows - 1.
+ * Keyframe packets (no MSF_DELTA in flags) carry MATRIX_FRAME_VALUE_BITS-bit values, packed LSB first.
+ * Delta packets carry zigzag varint differences against the same row in frame sequence - 1.
+ * Host that missed that frame should skip the row till the next keyframe.
+ */
+#define MATRIX_FRAME_VALUE_BITS 10
+#define MATRIX_FRAME_KEYFRAME_INTERVAL 32
+
+typedef struct {
+    uint16_t sequence;
+    uint32_t timestamp; // ms
+    uint8_t firstRow;
+    uint8_t rows;
+    uint8_t cols;
+    uint8_t flags; // matrixStreamFlags
+} __attribute__ ((packed)) matrix_frame_header_t;
+
+#define MATRIX_FRAME_HEADER_SIZE 10 // sizeof(matrix_frame_header_t), for preprocessor
+#define MATRIX_FRAME_DATA_SIZE (63 - MATRIX_FRAME_HEADER_SIZE)
+
 typedef union {
     struct {
         unsigned char response_type;
@@ -138,8 +393,51 @@ typedef union {
 #define CONFIG_TRANSFER_BLOCK_SIZE 32
 #define CONFIG_BLOCK_DATA_OFFSET 1
 
+/*
+ * V2 transfer - whole packet worth of data per block, host keeps up to CONFIG_V2_WINDOW blocks in flight
+ * and matches responses by block number. Image CRC (CRC-16/X-25, same as Qt's qChecksum) is checked before apply.
+ */
+#define CONFIG_V2_BLOCK_SIZE 62
+#define CONFIG_V2_WINDOW 8
+/*
+ * Apply carries image CRC, so half-uploaded or corrupt staging never goes live.
+ * Older hosts send payload[0] = 1 and no CRC - then every V1 block must have arrived since last apply.
+ */
+#define CONFIG_APPLY_CHECKED 2
+// Per-block CRCs, same algorithm - host transfers only the blocks that differ.
+#define CONFIG_HASHES_PER_PACKET ((63 - 2) / 2)
+// Extended config goes straight to flash - blocks are smaller so they tile flash rows.
+#define EXT_CONFIG_BLOCK_SIZE 32
+
+enum configRegion {
+    CONFIG_REGION_MAIN,
+    CONFIG_REGION_EXTENDED
+};
+
 #define MACRO_TYPE_ONKEYUP 0x80
 #define MACRO_TYPE_TAP 0x40
+// Not bound to a key - only reachable with MACRO_OP_CALL. Scancode byte is subroutine id.
+#define MACRO_TYPE_SUBROUTINE 0x20
+
+/*
+ * Macro bytecode, decoded straight from EEPROM/flash. Top bits select the opcode:
+ * 00dddd-- [key]          - type key, press to release delay is delayLib[dddd]
+ * 01r----- [key]          - press (r=0) or release (r=1) key
+ * 10nnnnnn [key] x (n+1)  - type n+1 keys, each with run delay
+ * 1100dddd                - set run delay to delayLib[dddd] (DELAYS_EVENT at macro start)
+ * 1101---- [mods]         - hold modifiers around next instruction. Bitmap, bit 0 = LCtrl .. bit 7 = RGUI
+ * 1110---- [id]           - call subroutine, up to MACRO_CALL_DEPTH levels deep
+ * 1111----                - end
+ */
+#define MACRO_OP_TYPE 0x00
+#define MACRO_OP_PRESS 0x40
+#define MACRO_OP_RUN 0x80
+#define MACRO_OP_RUN_DELAY 0xc0
+#define MACRO_OP_WRAP 0xd0
+#define MACRO_OP_CALL 0xe0
+#define MACRO_OP_END 0xf0
+#define MACRO_RUN_MAX 64
+#define MACRO_CALL_DEPTH 4
 
 #define DELAYS_EVENT 0
 #define DELAYS_TAP 1
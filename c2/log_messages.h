@@ -0,0 +1,52 @@
+/*
+ *
+ * Copyright (C) 2017 DMA <dma@ya.ru>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+*/
+
+#pragma once
+
+/*
+ * Firmware log messages. Firmware sends only message ID and raw arguments (see xlog),
+ * host expands them back into text with logFormats below.
+ * Add new messages at the end - IDs are positions in this list, and old FlightController should still be able to read them.
+ * Arguments are int32_t, so %d only.
+ */
+#define LOG_MESSAGES \
+    LOG_MESSAGE(LOG_TIME, "time: %d") \
+    LOG_MESSAGE(LOG_EEPROM_UPDATE, "Updating EEPROM GO!") \
+    LOG_MESSAGE(LOG_EEPROM_WRITTEN, "Written %d rows to slot %d, generation %d") \
+    LOG_MESSAGE(LOG_EWO, "EWO signal received: %d") \
+    LOG_MESSAGE(LOG_BOOTLOADER, "Jumping to bootloader..") \
+    LOG_MESSAGE(LOG_APPLY_CONFIG, "Applying config..") \
+    LOG_MESSAGE(LOG_RESET, "Resetting..") \
+    LOG_MESSAGE(LOG_QUARANTINE_RELEASE, "Releasing quarantined keys") \
+    LOG_MESSAGE(LOG_KEY_EXISTS, "Existing %d pos %d") \
+    LOG_MESSAGE(LOG_KRO, "Keyboard rollover error") \
+    LOG_MESSAGE(LOG_SCANCODE_LEVELS, "sc: %d %d @ %d ms, lvl %d/%d") \
+    LOG_MESSAGE(LOG_APPLY_REJECTED, "Config version %d rejected, not applied") \
+    LOG_MESSAGE(LOG_CONFIG_SLOT, "Config from slot %d, generation %d (valid: EEPROM %d, flash %d)") \
+    LOG_MESSAGE(LOG_WATCH_WAKE, "Woken by scancode %d, worst case latency %d us (%d ms interval + %d us pass)") \
+    LOG_MESSAGE(LOG_KEY_QUARANTINED, "Scancode %d quarantined: %d events, held %d s") \
+    LOG_MESSAGE(LOG_KEY_RECOVERED, "Scancode %d back from quarantine") \
+    LOG_MESSAGE(LOG_APPLY_INCOMPLETE, "Staged config CRC %d, host expects %d (checked: %d) - upload incomplete, not applied") \
+    LOG_MESSAGE(LOG_APPLY_BAD_COLUMN, "Column %d mapped to %d, out of range - config not applied") \
+    LOG_MESSAGE(LOG_CONFIG_TAIL_RESET, "Config tail predates this layout (magic %d) - tail features off")
+
+enum logMessage {
+#define LOG_MESSAGE(ID, FORMAT) ID,
+    LOG_MESSAGES
+#undef LOG_MESSAGE
+    LOG_MESSAGE_COUNT
+};
+
+static const char * const logFormats[] = {
+#define LOG_MESSAGE(ID, FORMAT) FORMAT,
+    LOG_MESSAGES
+#undef LOG_MESSAGE
+};
+
+#define LOG_MAX_ARGS 5
@@ -17,7 +17,33 @@
 #define CS_CONFIG_VERSION 2
 
 #define EEPROM_BYTESIZE 2048
+#define EEPROM_ROWS (EEPROM_BYTESIZE / 16)
+#define CONFIG_V2_BLOCKS ((EEPROM_BYTESIZE + CONFIG_V2_BLOCK_SIZE - 1) / CONFIG_V2_BLOCK_SIZE)
+// Last block is shorter.
+#define CONFIG_V2_BLOCK_LENGTH(BLOCK) ((BLOCK) == CONFIG_V2_BLOCKS - 1 ? EEPROM_BYTESIZE - (CONFIG_V2_BLOCKS - 1) * CONFIG_V2_BLOCK_SIZE : CONFIG_V2_BLOCK_SIZE)
 #define COMMONSENSE_BASE_SIZE 64
+// Fixed-size block at the very end of EEPROM - so it's at the same place regardless of matrix size.
+// Carved out of macro space. 0xff everywhere means "feature not configured".
+#define COMMONSENSE_TAIL_SIZE 256
+// Configs written before the tail existed have macros there. Without this in tailMagic
+// the tail is read as all 0xff and slot trailer isn't trusted.
+#define CONFIG_TAIL_MAGIC 0xc5a1
+
+#define CROSSTALK_ENTRIES 32
+#define WAKE_KEYS_MAX 8
+#define HOT_KEYS_MAX 8
+#define HOT_ROW_RATE_MAX 4
+#define COLUMN_MAP_SIZE 32
+
+/*
+ * Victim level is corrected by coefficient/256 of aggressor's excursion from its rest level.
+ * Victim and aggressor are scancodes (row * cols + col). Table ends at first victim == EMPTY_FLASH_BYTE.
+ */
+typedef struct {
+    uint8_t victim;
+    uint8_t aggressor;
+    uint8_t coefficient;
+} __attribute__ ((packed)) crosstalk_entry_t;
 
 #ifdef MATRIX_ROWS
 // Firmware. matrix dimensions compiled in.
@@ -48,14 +74,76 @@ typedef union {
         uint8_t deadBandLo[MATRIX_ROWS][MATRIX_COLS];
         uint8_t deadBandHi[MATRIX_ROWS][MATRIX_COLS];
         uint8_t layers[MATRIX_LAYERS][COMMONSENSE_MATRIX_SIZE];
-        uint8_t macros[EEPROM_BYTESIZE - COMMONSENSE_CONFIG_SIZE - (MATRIX_LAYERS * COMMONSENSE_MATRIX_SIZE)];
+        uint8_t macros[EEPROM_BYTESIZE - COMMONSENSE_CONFIG_SIZE - (MATRIX_LAYERS * COMMONSENSE_MATRIX_SIZE) - COMMONSENSE_TAIL_SIZE];
 #else
         // FlightController. Must work with what firmware tells it.
 #define COMMONSENSE_CONFIG_SIZE COMMONSENSE_BASE_SIZE
-        uint8_t stash[EEPROM_BYTESIZE - COMMONSENSE_CONFIG_SIZE];
+        uint8_t stash[EEPROM_BYTESIZE - COMMONSENSE_CONFIG_SIZE - COMMONSENSE_TAIL_SIZE];
 #endif
+        // TAIL - fixed position, count down from the end of EEPROM.
+        crosstalk_entry_t crosstalk[CROSSTALK_ENTRIES];
+        // Levels drift by temperatureSlope/16 per degree C away from temperatureReference. Enabled by CSF_TC.
+        // Either one EMPTY_FLASH_BYTE (-1) means never learned - compensation stays off. Host doesn't store -1 for either.
+        int8_t temperatureReference;
+        int8_t temperatureSlope;
+        // Key quarantine. Events per second above which key is considered broken, 0xff - firmware default.
+        uint8_t keyEventLimit;
+        // Seconds key may stay pressed without a single event, 0 or 0xff - never quarantine stuck keys.
+        uint8_t stuckKeyTimeout;
+        // Tenths of a second of idle matrix before each scan rate downshift, 0xff - always scan at full rate.
+        uint8_t scanGovernorIdle;
+        // Remote wakeup watch. Only rows holding these scancodes are scanned and only these keys wake the host.
+        // List ends at first EMPTY_FLASH_BYTE, empty list - whole matrix.
+        uint8_t wakeKeys[WAKE_KEYS_MAX];
+        // ms between watch scan passes, 0 or 0xff - SUSPEND_SYSTIMER_DIVISOR.
+        uint8_t watchInterval;
+        // Rows holding these scancodes are scanned hotRowRate times per pass, interleaved with the rest.
+        // List ends at first EMPTY_FLASH_BYTE. hotRowRate 0, 1 or 0xff - every row once.
+        uint8_t hotKeys[HOT_KEYS_MAX];
+        uint8_t hotRowRate;
+        // Physical column each logical column is read from. Physical columns are numbered the way they come
+        // from ADCs - ADC0 channels first, then ADC1. 0xff in the first entry - logical == physical,
+        // 0xff elsewhere - column not connected.
+        uint8_t columnMap[COLUMN_MAP_SIZE];
+        uint8_t _RESERVED_TAIL[COMMONSENSE_TAIL_SIZE - CROSSTALK_ENTRIES * sizeof(crosstalk_entry_t) - 5 - WAKE_KEYS_MAX - 1 - HOT_KEYS_MAX - 1 - COLUMN_MAP_SIZE - 6];
+        uint16_t tailMagic;
+        // Slot trailer, set by firmware on commit. CRC-16/X-25 of everything before configCrc.
+        uint16_t configGeneration;
+        uint16_t configCrc;
     };
     uint8_t raw[EEPROM_BYTESIZE];
 } psoc_eeprom_t;
 
+/*
+ * Extended config - flash region next to config slots, for what doesn't fit EEPROM.
+ * Extra layers come after EEPROM ones: layer MATRIX_LAYERS is layers[0] here. Macros here are
+ * looked up after EEPROM ones. Host writes it whole and seals with CRC (CRC-16/X-25 of everything
+ * before extCrc) - firmware ignores it unless CRC and version check out.
+ */
+#define EXT_CONFIG_BYTESIZE 4096
+#define EXT_CONFIG_VERSION 1
+#define EXT_CONFIG_HEADER_SIZE 16
+#define EXT_CONFIG_BLOCKS (EXT_CONFIG_BYTESIZE / EXT_CONFIG_BLOCK_SIZE)
+
+typedef union {
+    struct {
+        uint8_t extVersion;
+        uint8_t extLayerCount;
+        uint8_t _RESERVED_EXT[EXT_CONFIG_HEADER_SIZE - 2];
+#ifdef MATRIX_ROWS
+        // Storage is reserved for all layers up to ABSOLUTE_MAX_LAYERS, extLayerCount says how many are in use.
+        // Layer keys A8-AF only reach layers 0-3 - layers here are selected through layerConditions only.
+#define EXT_LAYERS_MAX (ABSOLUTE_MAX_LAYERS - MATRIX_LAYERS)
+        uint8_t layers[EXT_LAYERS_MAX][COMMONSENSE_MATRIX_SIZE];
+        uint8_t macros[EXT_CONFIG_BYTESIZE - EXT_CONFIG_HEADER_SIZE - EXT_LAYERS_MAX * COMMONSENSE_MATRIX_SIZE - 4];
+#else
+        // FlightController. Layers take (ABSOLUTE_MAX_LAYERS - matrixLayers) tables, macros - the rest.
+        uint8_t stash[EXT_CONFIG_BYTESIZE - EXT_CONFIG_HEADER_SIZE - 4];
+#endif
+        uint8_t _RESERVED_EXT_TAIL[2];
+        uint16_t extCrc;
+    };
+    uint8_t raw[EXT_CONFIG_BYTESIZE];
+} ext_config_t;
+
 #define EMPTY_FLASH_BYTE 0xff
\ No newline at end of file
@@ -6,15 +6,13 @@
  * it under the terms of the GNU General Public License version 2 as
  * published by the Free Software Foundation. 
 */
-#include <stdio.h>
 #include <project.h>
+#include <stddef.h>
 #include "globals.h"
 #include "exp.h"
 
 #include "PSoC_USB.h"
-
-// for xprintf - stdio + stdarg
-#include <stdarg.h>
+#include "column_map.h"
 
 CY_ISR_PROTO(Suspend_ISR);
 
@@ -31,17 +29,116 @@ void report_status(void)
     outbox.payload[3] = dieTemperature[0];
     outbox.payload[4] = dieTemperature[1];
     usb_send_c2();
-    xprintf("time: %d", systime);
+    xlog(LOG_TIME, systime);
     //xprintf("LED status: %d %d %d %d %d", led_status&0x01, led_status&0x02, led_status&0x04, led_status&0x08, led_status&0x10);
 }
 
+void perf_init(void)
+{
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CYCCNT = 0;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+    memset(perf.raw, 0, sizeof(perf));
+    perf.busClockKHz = BCLK__BUS_CLK__KHZ;
+    memset(power_perf.raw, 0, sizeof(power_perf));
+    memset(scan_integrity.raw, 0, sizeof(scan_integrity));
+}
+
+void report_perf(bool reset)
+{
+    perf.uptime = systime;
+    perf.usbQueueOccupancy = 0;
+    for (uint8_t i = 0; i <= KEYCODE_BUFFER_END; i++)
+    {
+        if (USBQueue[i].keycode != USBCODE_NOEVENT)
+        {
+            perf.usbQueueOccupancy++;
+        }
+    }
+    memset(outbox.raw, 0, sizeof(outbox));
+    outbox.response_type = C2RESPONSE_PERF;
+    uint8_t enableInterrupts = CyEnterCriticalSection();
+    memcpy(outbox.payload, perf.raw, sizeof(perf));
+    if (reset)
+    {
+        uint16_t passes = perf.scanPassesPerSecond;
+        memset(perf.raw, 0, sizeof(perf));
+        perf.busClockKHz = BCLK__BUS_CLK__KHZ;
+        perf.scanPassesPerSecond = passes;
+    }
+    CyExitCriticalSection(enableInterrupts);
+    usb_send_c2();
+    memset(outbox.raw, 0, sizeof(outbox));
+    outbox.response_type = C2RESPONSE_POWER;
+    memcpy(outbox.payload, power_perf.raw, sizeof(power_perf));
+    if (reset)
+    {
+        memset(power_perf.raw, 0, sizeof(power_perf));
+    }
+    usb_send_c2();
+    memset(outbox.raw, 0, sizeof(outbox));
+    outbox.response_type = C2RESPONSE_SCAN_INTEGRITY;
+    enableInterrupts = CyEnterCriticalSection();
+    memcpy(outbox.payload, scan_integrity.raw, sizeof(scan_integrity));
+    if (reset)
+    {
+        // Current slack is state, not a counter.
+        uint8_t slack = scan_integrity.slack;
+        memset(scan_integrity.raw, 0, sizeof(scan_integrity));
+        scan_integrity.slack = slack;
+        scan_integrity.slackMax = slack;
+    }
+    CyExitCriticalSection(enableInterrupts);
+    usb_send_c2();
+}
+
+// Config rows changed since last commit to each slot, one bit per EEPROM row.
+static uint8_t config_dirty[CONFIG_SLOTS][EEPROM_ROWS / 8];
+// Slot holding the config we run, and its generation.
+static uint8_t config_slot;
+static uint16_t config_generation;
+
+static struct {
+    bool active;
+    bool writing;
+    uint8_t slot;
+    uint8_t row;
+    uint8_t rows_written;
+} config_commit;
+
+static void config_mark_dirty(uint16_t offset, uint16_t size)
+{
+    for (uint16_t row = offset / CYDEV_EEPROM_ROW_SIZE; row <= (offset + size - 1) / CYDEV_EEPROM_ROW_SIZE; row++)
+    {
+        for (uint8_t slot = 0; slot < CONFIG_SLOTS; slot++)
+        {
+            config_dirty[slot][row / 8] |= 1 << (row % 8);
+        }
+    }
+    // Trailer CRC covers everything, so it's stale whenever anything changes.
+    for (uint8_t slot = 0; slot < CONFIG_SLOTS; slot++)
+    {
+        config_dirty[slot][(EEPROM_ROWS - 1) / 8] |= 1 << ((EEPROM_ROWS - 1) % 8);
+    }
+}
+
+// V1 blocks received since last apply - unchecked apply needs all of them.
+#define CONFIG_V1_BLOCKS (EEPROM_BYTESIZE / CONFIG_TRANSFER_BLOCK_SIZE)
+static uint8_t config_v1_received[(CONFIG_V1_BLOCKS + 7) / 8];
+
 void receive_config_block(OUT_c2packet_t *inbox){
     // TODO define offset via transfer block size and packet size
-    memcpy(
-        config.raw + (inbox->payload[0] * CONFIG_TRANSFER_BLOCK_SIZE),
-        inbox->payload + CONFIG_BLOCK_DATA_OFFSET,
-        CONFIG_TRANSFER_BLOCK_SIZE
-    );
+    // Old hosts send one block past the end - ack it, but don't write.
+    if (inbox->payload[0] < EEPROM_BYTESIZE / CONFIG_TRANSFER_BLOCK_SIZE)
+    {
+        memcpy(
+            config_staging.raw + (inbox->payload[0] * CONFIG_TRANSFER_BLOCK_SIZE),
+            inbox->payload + CONFIG_BLOCK_DATA_OFFSET,
+            CONFIG_TRANSFER_BLOCK_SIZE
+        );
+        config_mark_dirty(inbox->payload[0] * CONFIG_TRANSFER_BLOCK_SIZE, CONFIG_TRANSFER_BLOCK_SIZE);
+        config_v1_received[inbox->payload[0] / 8] |= 1 << (inbox->payload[0] % 8);
+    }
     memset(outbox.raw, 0, sizeof(outbox));
     outbox.response_type = C2RESPONSE_CONFIG;
     outbox.payload[0] = inbox->payload[0];
@@ -54,20 +151,149 @@ void send_config_block(OUT_c2packet_t *inbox){
     outbox.payload[0] = inbox->payload[0];
     memcpy(
         outbox.payload + CONFIG_BLOCK_DATA_OFFSET,
-        config.raw + (inbox->payload[0] * CONFIG_TRANSFER_BLOCK_SIZE),
+        config_staging.raw + (inbox->payload[0] * CONFIG_TRANSFER_BLOCK_SIZE),
         CONFIG_TRANSFER_BLOCK_SIZE
     );
     usb_send_c2();
 }
 
-void set_hardware_parameters(void)
+void receive_config_block_v2(OUT_c2packet_t *inbox)
+{
+    uint8_t block = inbox->payload[0];
+    if (block >= CONFIG_V2_BLOCKS)
+    {
+        return;
+    }
+    memcpy(config_staging.raw + block * CONFIG_V2_BLOCK_SIZE, inbox->payload + 1, CONFIG_V2_BLOCK_LENGTH(block));
+    config_mark_dirty(block * CONFIG_V2_BLOCK_SIZE, CONFIG_V2_BLOCK_LENGTH(block));
+    memset(outbox.raw, 0, sizeof(outbox));
+    outbox.response_type = C2RESPONSE_CONFIG_V2;
+    outbox.payload[0] = block;
+    usb_send_c2();
+}
+
+void send_config_block_v2(OUT_c2packet_t *inbox)
+{
+    uint8_t block = inbox->payload[0];
+    if (block >= CONFIG_V2_BLOCKS)
+    {
+        return;
+    }
+    memset(outbox.raw, 0, sizeof(outbox));
+    outbox.response_type = C2RESPONSE_CONFIG_V2;
+    outbox.payload[0] = block;
+    memcpy(outbox.payload + 1, config_staging.raw + block * CONFIG_V2_BLOCK_SIZE, CONFIG_V2_BLOCK_LENGTH(block));
+    usb_send_c2();
+}
+
+// CRC-16/X-25 - what Qt's qChecksum does.
+uint16_t crc16(const uint8_t *data, uint16_t size)
+{
+    uint16_t crc = 0xffff;
+    while (size--)
+    {
+        crc ^= *data++;
+        for (uint8_t i = 0; i < 8; i++)
+        {
+            crc = (crc & 1) ? (crc >> 1) ^ 0x8408 : (crc >> 1);
+        }
+    }
+    return ~crc;
+}
+
+/*
+ * Image for C2CMD_CONFIG_HASHES/C2CMD_CONFIG_CRC. Staging for main config,
+ * flash for extended one - with pending upload row written first.
+ */
+static const uint8_t *config_region(uint8_t region, uint16_t *size, uint8_t *block_size)
+{
+    if (region == CONFIG_REGION_EXTENDED)
+    {
+        ext_config_flush();
+        *size = EXT_CONFIG_BYTESIZE;
+        *block_size = EXT_CONFIG_BLOCK_SIZE;
+        return ext_config.raw;
+    }
+    *size = EEPROM_BYTESIZE;
+    *block_size = CONFIG_V2_BLOCK_SIZE;
+    return config_staging.raw;
+}
+
+void report_config_crc(OUT_c2packet_t *inbox)
+{
+    uint16_t size;
+    uint8_t block_size;
+    const uint8_t *image = config_region(inbox->payload[0], &size, &block_size);
+    uint16_t crc = crc16(image, size);
+    memset(outbox.raw, 0, sizeof(outbox));
+    outbox.response_type = C2RESPONSE_CONFIG_CRC;
+    outbox.payload[0] = crc & 0xff;
+    outbox.payload[1] = crc >> 8;
+    usb_send_c2();
+}
+
+void report_config_hashes(OUT_c2packet_t *inbox)
+{
+    uint8_t block = inbox->payload[0];
+    uint8_t count = 0;
+    uint16_t size;
+    uint8_t block_size;
+    const uint8_t *image = config_region(inbox->payload[1], &size, &block_size);
+    memset(outbox.raw, 0, sizeof(outbox));
+    outbox.response_type = C2RESPONSE_CONFIG_HASHES;
+    outbox.payload[0] = block;
+    for (; block * block_size < size && count < CONFIG_HASHES_PER_PACKET; block++, count++)
+    {
+        uint16_t length = size - block * block_size;
+        uint16_t crc = crc16(image + block * block_size, length < block_size ? length : block_size);
+        outbox.payload[2 + count * 2] = crc & 0xff;
+        outbox.payload[3 + count * 2] = crc >> 8;
+    }
+    outbox.payload[1] = count;
+    usb_send_c2();
+}
+
+void set_hardware_parameters(psoc_eeprom_t *cfg)
+{
+    cfg->capsenseFlags = FORCE_BIT(cfg->capsenseFlags, CSF_NL, NORMALLY_LOW);
+    cfg->matrixRows = MATRIX_ROWS;
+    cfg->matrixCols = MATRIX_COLS;
+    cfg->matrixLayers = MATRIX_LAYERS;
+}
+
+static bool config_valid(const psoc_eeprom_t *cfg)
+{
+    return cfg->configVersion == CS_CONFIG_VERSION
+        && cfg->tailMagic == CONFIG_TAIL_MAGIC
+        && cfg->configCrc == crc16(cfg->raw, offsetof(psoc_eeprom_t, configCrc));
+}
+
+/*
+ * Tail without the magic is macro bytes from older layout - treat it as not configured.
+ * Returns true if the tail had to be reset.
+ */
+static bool config_check_tail(psoc_eeprom_t *cfg)
+{
+    if (cfg->tailMagic == CONFIG_TAIL_MAGIC)
+    {
+        return false;
+    }
+    xlog(LOG_CONFIG_TAIL_RESET, cfg->tailMagic);
+    memset(cfg->crosstalk, EMPTY_FLASH_BYTE, offsetof(psoc_eeprom_t, tailMagic) - offsetof(psoc_eeprom_t, crosstalk));
+    cfg->tailMagic = CONFIG_TAIL_MAGIC;
+    return true;
+}
+
+static void config_seal(psoc_eeprom_t *cfg, uint16_t generation)
 {
-    config.capsenseFlags = FORCE_BIT(config.capsenseFlags, CSF_NL, NORMALLY_LOW);
-    config.matrixRows = MATRIX_ROWS;
-    config.matrixCols = MATRIX_COLS;
-    config.matrixLayers = MATRIX_LAYERS;
+    cfg->configGeneration = generation;
+    cfg->configCrc = crc16(cfg->raw, offsetof(psoc_eeprom_t, configCrc));
 }
 
+/*
+ * Picks the newest slot with good CRC. If neither is good (interrupted first commit, or
+ * config written before slots existed) EEPROM is used as is, checked for version below.
+ */
 void load_config(void){
     EEPROM_Start();
     CyDelayUs(5);
@@ -82,34 +308,302 @@ void load_config(void){
     CyEEPROM_ReadRelease();
     CyExitCriticalSection(interruptState);
     EEPROM_Stop();
-    set_hardware_parameters();
+    // Staging is free at this point - use it to look at the flash slot.
+    memcpy(config_staging.raw, (void *)CONFIG_FLASH_BASE, sizeof(config_staging.raw));
+    bool eeprom_valid = config_valid(&config);
+    bool flash_valid = config_valid(&config_staging);
+    config_slot = CONFIG_SLOT_EEPROM;
+    if (flash_valid && (!eeprom_valid || (int16_t)(config_staging.configGeneration - config.configGeneration) > 0))
+    {
+        config_slot = CONFIG_SLOT_FLASH;
+        memcpy(config.raw, config_staging.raw, sizeof(config.raw));
+    }
+    config_generation = (eeprom_valid || flash_valid) ? config.configGeneration : 0;
+    xlog(LOG_CONFIG_SLOT, config_slot, config_generation, eeprom_valid, flash_valid);
+    // No idea what the other slot has - compare all of it on next commit.
+    memset(config_dirty[config_slot ^ 1], 0xff, sizeof(config_dirty[0]));
+    if (config_check_tail(&config))
+    {
+        config_mark_dirty(offsetof(psoc_eeprom_t, crosstalk), COMMONSENSE_TAIL_SIZE);
+    }
+    set_hardware_parameters(&config);
     if (config.configVersion != CS_CONFIG_VERSION)
     {
         // Unexpected config version - not sure calibration data are there!
         config.capsenseFlags = FORCE_BIT(config.capsenseFlags, CSF_OE, 0);
         status_register.emergency_stop = true;
     }
+    memcpy(config_staging.raw, config.raw, sizeof(config.raw));
 }
 
 void apply_config(void){
+    trace(TRACE_CONFIG_APPLY, 0, 0);
     exp_init();
     pipeline_init(); // calls scan_reset
 }
 
+/*
+ * Staging image must be the one host verified - CRC from apply command,
+ * or, for hosts that don't send it, full V1 upload since last apply.
+ */
+static bool staged_config_complete(OUT_c2packet_t *inbox)
+{
+    uint16_t crc = crc16(config_staging.raw, EEPROM_BYTESIZE);
+    bool checked = inbox->payload[0] == CONFIG_APPLY_CHECKED;
+    uint16_t expected = inbox->payload[1] | (inbox->payload[2] << 8);
+    bool complete = true;
+    if (checked)
+    {
+        complete = (crc == expected);
+    }
+    else
+    {
+        for (uint8_t i = 0; i < CONFIG_V1_BLOCKS; i++)
+        {
+            complete = complete && (config_v1_received[i / 8] & (1 << (i % 8)));
+        }
+    }
+    memset(config_v1_received, 0, sizeof(config_v1_received));
+    if (!complete)
+    {
+        xlog(LOG_APPLY_INCOMPLETE, crc, expected, checked);
+    }
+    return complete;
+}
+
+/*
+ * Swaps staging config in without stopping the world. Copy happens with interrupts off,
+ * so scan ISR sees it between rows. Only keys with new thresholds lose their filter state.
+ */
+void apply_staged_config(OUT_c2packet_t *inbox)
+{
+    if (!staged_config_complete(inbox))
+    {
+        return;
+    }
+    if (config_check_tail(&config_staging))
+    {
+        config_mark_dirty(offsetof(psoc_eeprom_t, crosstalk), COMMONSENSE_TAIL_SIZE);
+    }
+    set_hardware_parameters(&config_staging);
+    if (config_staging.configVersion != CS_CONFIG_VERSION)
+    {
+        xlog(LOG_APPLY_REJECTED, config_staging.configVersion);
+        return;
+    }
+    // Channel the board doesn't have is a broken map, not a disconnected column.
+    uint8_t bad_column = column_map_bad_entry(config_staging.columnMap);
+    if (bad_column < MATRIX_COLS)
+    {
+        xlog(LOG_APPLY_BAD_COLUMN, bad_column, config_staging.columnMap[bad_column]);
+        return;
+    }
+    uint32_t changed_keys[MATRIX_ROWS];
+    uint8_t changed_count = 0;
+    // Remapped column reads another physical channel - filter state there is meaningless.
+    uint32_t remapped = 0;
+    for (uint8_t j = 0; j < MATRIX_COLS; j++)
+    {
+        uint8_t was = column_map_physical(config.columnMap, j);
+        uint8_t now = column_map_physical(config_staging.columnMap, j);
+        if (was != now)
+        {
+            remapped |= (1 << j);
+        }
+    }
+    for (uint8_t i = 0; i < MATRIX_ROWS; i++)
+    {
+        changed_keys[i] = 0;
+        for (uint8_t j = 0; j < MATRIX_COLS; j++)
+        {
+            if (config_staging.deadBandHi[i][j] != config.deadBandHi[i][j]
+             || config_staging.deadBandLo[i][j] != config.deadBandLo[i][j]
+             || (remapped & (1 << j)))
+            {
+                changed_keys[i] |= (1 << j);
+                changed_count++;
+            }
+        }
+    }
+    bool crosstalk_changed = memcmp(config_staging.crosstalk, config.crosstalk, sizeof(config.crosstalk)) != 0;
+    bool exp_changed = config_staging.expMode != config.expMode
+                    || config_staging.expParam1 != config.expParam1
+                    || config_staging.expParam2 != config.expParam2;
+    uint8_t enableInterrupts = CyEnterCriticalSection();
+    memcpy(config.raw, config_staging.raw, sizeof(config.raw));
+    scan_config_changed(changed_keys, crosstalk_changed);
+    CyExitCriticalSection(enableInterrupts);
+    if (exp_changed)
+    {
+        exp_init();
+    }
+    trace(TRACE_CONFIG_APPLY, 1, changed_count);
+}
+
+static inline uint16_t config_slot_row_size(uint8_t slot)
+{
+    return slot == CONFIG_SLOT_EEPROM ? CYDEV_EEPROM_ROW_SIZE : CYDEV_FLS_ROW_SIZE;
+}
+
+// Checks and clears dirty bits covering slot row.
+static bool config_take_dirty(uint8_t slot, uint8_t row)
+{
+    uint8_t units = config_slot_row_size(slot) / CYDEV_EEPROM_ROW_SIZE;
+    bool dirty = false;
+    for (uint8_t unit = row * units; unit < (row + 1) * units; unit++)
+    {
+        if (config_dirty[slot][unit / 8] & (1 << (unit % 8)))
+        {
+            dirty = true;
+            config_dirty[slot][unit / 8] &= ~(1 << (unit % 8));
+        }
+    }
+    return dirty;
+}
+
+static bool config_slot_row_matches(uint8_t slot, uint8_t row)
+{
+    uint16_t size = config_slot_row_size(slot);
+    if (slot == CONFIG_SLOT_FLASH)
+    {
+        return memcmp(config_staging.raw + row * size, (uint8_t *)CONFIG_FLASH_BASE + row * size, size) == 0;
+    }
+    uint8 interruptState = CyEnterCriticalSection();
+    CyEEPROM_ReadReserve();
+    bool matches = memcmp(config_staging.raw + row * size, (uint8_t *)CYDEV_EE_BASE + row * size, size) == 0;
+    CyEEPROM_ReadRelease();
+    CyExitCriticalSection(interruptState);
+    return matches;
+}
+
+// Same as EEPROM_StartWrite, but for flash slot rows. Completion is polled with EEPROM_Query - it's SPC-generic.
+static cystatus config_flash_start_write(uint8_t row)
+{
+    uint32_t address = CONFIG_FLASH_BASE + row * CYDEV_FLS_ROW_SIZE;
+    uint8_t array = CY_SPC_FIRST_FLASH_ARRAYID + address / CYDEV_FLS_SECTOR_SIZE;
+    uint16_t array_row = (address % CYDEV_FLS_SECTOR_SIZE) / CYDEV_FLS_ROW_SIZE;
+    CySpcStart();
+    if (CySpcLock() != CYRET_SUCCESS)
+    {
+        return CYRET_LOCKED;
+    }
+    if (CySpcLoadRowFull(array, array_row, config_staging.raw + row * CYDEV_FLS_ROW_SIZE, CYDEV_FLS_ROW_SIZE) == CYRET_STARTED)
+    {
+        while (CY_SPC_BUSY)
+        {
+            // Loading row latch is quick.
+        }
+        if (CY_SPC_STATUS_SUCCESS == CY_SPC_READ_STATUS
+         && CySpcWriteRow(array, array_row, dieTemperature[0], dieTemperature[1]) == CYRET_STARTED)
+        {
+            return CYRET_STARTED;
+        }
+    }
+    CySpcUnlock();
+    return CYRET_UNKNOWN;
+}
+
+static cystatus config_slot_start_write(uint8_t slot, uint8_t row)
+{
+    if (slot == CONFIG_SLOT_FLASH)
+    {
+        return config_flash_start_write(row);
+    }
+    return EEPROM_StartWrite(config_staging.raw + row * CYDEV_EEPROM_ROW_SIZE, row);
+}
+
+/*
+ * Starts committing dirty rows to the slot we're not running from. Actual writing happens
+ * in save_config_step, one row write at a time, so scanning goes on while EEPROM is busy.
+ * Trailer with generation and CRC is written last - until then the old slot is the good one.
+ */
 void save_config(void){
-    set_hardware_parameters();
+    if (config_check_tail(&config_staging))
+    {
+        config_mark_dirty(offsetof(psoc_eeprom_t, crosstalk), COMMONSENSE_TAIL_SIZE);
+    }
+    set_hardware_parameters(&config_staging);
+    config_mark_dirty(0, COMMONSENSE_BASE_SIZE);
+    if (config_commit.active)
+    {
+        // Already committing - new dirty rows will be picked up.
+        return;
+    }
     EEPROM_Start();
     CyDelayUs(5);
     EEPROM_UpdateTemperature();
-    xprintf("Updating EEPROM GO!");
-    uint16 bytes_modified = 0;
-    for(uint16 i = 0; i < EEPROM_BYTESIZE; i++)
-        if(config.raw[i] != EEPROM_ReadByte(i)) {
-            EEPROM_WriteByte(config.raw[i], i);
-            bytes_modified++;
+    xlog(LOG_EEPROM_UPDATE);
+    config_commit.active = true;
+    config_commit.writing = false;
+    config_commit.slot = config_slot ^ 1;
+    config_commit.rows_written = 0;
+}
+
+void save_config_step(void)
+{
+    if (!config_commit.active)
+    {
+        return;
+    }
+    uint8_t slot = config_commit.slot;
+    uint16_t row_size = config_slot_row_size(slot);
+    uint8_t rows = EEPROM_BYTESIZE / row_size;
+    if (config_commit.writing)
+    {
+        cystatus status = EEPROM_Query();
+        if (status == CYRET_STARTED)
+        {
+            return;
+        }
+        config_commit.writing = false;
+        if (slot == CONFIG_SLOT_FLASH)
+        {
+            CyFlushCache();
+        }
+        if (status != CYRET_SUCCESS)
+        {
+            config_mark_dirty(config_commit.row * row_size, row_size);
+            config_commit.rows_written--;
+        }
+    }
+    for (uint8_t row = 0; row < rows; row++)
+    {
+        if (!config_take_dirty(slot, row))
+        {
+            continue;
+        }
+        if (row == rows - 1)
+        {
+            config_seal(&config_staging, config_generation + 1);
+        }
+        if (config_slot_row_matches(slot, row))
+        {
+            continue;
+        }
+        if (config_slot_start_write(slot, row) != CYRET_STARTED)
+        {
+            // SPC busy with something else - retry on next step.
+            config_mark_dirty(row * row_size, row_size);
+            return;
         }
+        config_commit.writing = true;
+        config_commit.row = row;
+        config_commit.rows_written++;
+        return;
+    }
+    config_commit.active = false;
+    config_slot = slot;
+    config_generation++;
     EEPROM_Stop();
-    xprintf("Written %d bytes!", bytes_modified);
+    xlog(LOG_EEPROM_WRITTEN, config_commit.rows_written, slot, config_generation);
+}
+
+void save_config_flush(void)
+{
+    while (config_commit.active)
+    {
+        save_config_step();
+    }
 }
 
 void process_msg(OUT_c2packet_t * inbox)
@@ -118,7 +612,7 @@ void process_msg(OUT_c2packet_t * inbox)
     switch (inbox->command) {
     case C2CMD_EWO:
         status_register.emergency_stop = inbox->payload[0];
-        xprintf("EWO signal received: %d", inbox->payload[0]);
+        xlog(LOG_EWO, inbox->payload[0]);
         scan_reset();
         break;
     case C2CMD_GET_STATUS:
@@ -129,7 +623,9 @@ void process_msg(OUT_c2packet_t * inbox)
         report_status();
         break;
     case C2CMD_ENTER_BOOTLOADER:
-        xprintf("Jumping to bootloader..");
+        save_config_flush();
+        xlog(LOG_BOOTLOADER);
+        xlog_flush();
         Boot_Load(); //Does not return, no need for break
     case C2CMD_UPLOAD_CONFIG:
         receive_config_block(inbox);
@@ -137,30 +633,212 @@ void process_msg(OUT_c2packet_t * inbox)
     case C2CMD_DOWNLOAD_CONFIG:
         send_config_block(inbox);
         break;
+    case C2CMD_UPLOAD_CONFIG_V2:
+        receive_config_block_v2(inbox);
+        break;
+    case C2CMD_DOWNLOAD_CONFIG_V2:
+        send_config_block_v2(inbox);
+        break;
+    case C2CMD_CONFIG_CRC:
+        report_config_crc(inbox);
+        break;
+    case C2CMD_CONFIG_HASHES:
+        report_config_hashes(inbox);
+        break;
+    case C2CMD_UPLOAD_EXT_CONFIG:
+        ext_config_receive_block(inbox);
+        break;
+    case C2CMD_DOWNLOAD_EXT_CONFIG:
+        ext_config_send_block(inbox);
+        break;
     case C2CMD_APPLY_CONFIG:
-        xprintf("Applying config..");
-        apply_config();
+        xlog(LOG_APPLY_CONFIG);
+        apply_staged_config(inbox);
         report_status();
         break;
     case C2CMD_COMMIT:
         save_config();
         break;
     case C2CMD_ROLLBACK:
-        xprintf("Resetting..");
+        save_config_flush();
+        xlog(LOG_RESET);
+        xlog_flush();
         CySoftwareReset(); //Does not return, no need for break.
     case C2CMD_GET_MATRIX_STATE:
         status_register.matrix_output = inbox->payload[0];
+        scan_matrix_stream(false, 0, 0);
+        scan_reset();
+        break;
+    case C2CMD_MATRIX_STREAM:
+        status_register.matrix_output = inbox->payload[0];
+        scan_matrix_stream(inbox->payload[0], inbox->payload[1], inbox->payload[2]);
         scan_reset();
         break;
+    case C2CMD_GET_PERF:
+        report_perf(inbox->payload[0]);
+        break;
+    case C2CMD_TRACE:
+        switch (inbox->payload[0])
+        {
+        case TRACE_ARM:
+            trace_arm();
+            break;
+        case TRACE_FREEZE:
+            trace_freeze();
+            break;
+        case TRACE_DOWNLOAD:
+            trace_send_chunk(inbox->payload[1] | (inbox->payload[2] << 8));
+            break;
+        default:
+            break;
+        }
+        break;
+    case C2CMD_SELFTEST:
+        switch (inbox->payload[0])
+        {
+        case SELFTEST_START:
+            scan_selftest_start(inbox->payload[1]);
+            break;
+        case SELFTEST_DOWNLOAD:
+            scan_selftest_send_chunk(inbox->payload[1]);
+            break;
+        default:
+            break;
+        }
+        break;
+    case C2CMD_GET_HEALTH:
+        if (inbox->payload[0])
+        {
+            xlog(LOG_QUARANTINE_RELEASE);
+            scan_release_quarantine();
+        }
+        report_key_health();
+        break;
     default:
         break;
     }
 }
 
+// Indexed by endpoint number - KBD_EP..SYSTEM_EP.
+static struct {
+    uint8_t data[HID_TX_MAX_REPORT];
+    uint8_t size;
+    bool pending;
+} hid_tx[SYSTEM_EP + 1];
+
+static IN_c2packet_t c2_tx_queue[C2_TX_QUEUE_SIZE];
+static uint8_t c2_tx_readpos;
+static uint8_t c2_tx_writepos;
+
+// Interrupts must be disabled or we must be in endpoint ISR.
+static inline void hid_tx_service(uint8_t ep)
+{
+    if (hid_tx[ep].pending && USB_GetEPState(ep) == USB_IN_BUFFER_EMPTY)
+    {
+        USB_LoadInEP(ep, hid_tx[ep].data, hid_tx[ep].size);
+        hid_tx[ep].pending = false;
+    }
+}
+
+// Interrupts must be disabled or we must be in endpoint ISR.
+static inline void c2_tx_service(void)
+{
+    if (c2_tx_readpos != c2_tx_writepos && USB_GetEPState(OUTBOX_EP) == USB_IN_BUFFER_EMPTY)
+    {
+        USB_LoadInEP(OUTBOX_EP, c2_tx_queue[c2_tx_readpos].raw, sizeof(c2_tx_queue[0].raw));
+        c2_tx_readpos = C2_TX_QUEUE_NEXT(c2_tx_readpos);
+    }
+}
+
+void usb_send_report(uint8_t ep, uint8_t *report, uint8_t size)
+{
+    uint8_t enableInterrupts = CyEnterCriticalSection();
+    if (hid_tx[ep].pending)
+    {
+        // Host hasn't seen previous state yet - and now it never will.
+        perf.reportsCollapsed++;
+    }
+    memcpy(hid_tx[ep].data, report, size);
+    hid_tx[ep].size = size;
+    hid_tx[ep].pending = true;
+    if (power_state == DEVSTATE_FULL_THROTTLE)
+    {
+        hid_tx_service(ep);
+    }
+    CyExitCriticalSection(enableInterrupts);
+}
+
 void usb_send_c2(void)
-{   
-    USB_WAIT_FOR_IN_EP(OUTBOX_EP);
-    USB_LoadInEP(OUTBOX_EP, outbox.raw, sizeof(outbox.raw));
+{
+    uint8_t enableInterrupts = CyEnterCriticalSection();
+    if (C2_TX_QUEUE_NEXT(c2_tx_writepos) == c2_tx_readpos)
+    {
+        perf.c2Drops++;
+        CyExitCriticalSection(enableInterrupts);
+        return;
+    }
+    memcpy(c2_tx_queue[c2_tx_writepos].raw, outbox.raw, sizeof(outbox.raw));
+    c2_tx_writepos = C2_TX_QUEUE_NEXT(c2_tx_writepos);
+    if (power_state == DEVSTATE_FULL_THROTTLE)
+    {
+        c2_tx_service();
+    }
+    CyExitCriticalSection(enableInterrupts);
+    perf.reportsC2++;
+    trace(TRACE_REPORT, OUTBOX_EP, 0);
+}
+
+bool usb_c2_idle(void)
+{
+    return c2_tx_readpos == c2_tx_writepos && USB_GetEPState(OUTBOX_EP) == USB_IN_BUFFER_EMPTY;
+}
+
+uint8_t usb_c2_free(void)
+{
+    return (c2_tx_readpos - c2_tx_writepos - 1) & (C2_TX_QUEUE_SIZE - 1);
+}
+
+// For last words before reset - waits until host picks everything up.
+void usb_c2_flush(void)
+{
+    while (!usb_c2_idle())
+    {
+        if (power_state != DEVSTATE_FULL_THROTTLE)
+        {
+            return;
+        }
+    }
+}
+
+// Endpoint ISRs only fire on completed transfer - restart the queues when there's none in flight.
+void usb_tx_kick(void)
+{
+    uint8_t enableInterrupts = CyEnterCriticalSection();
+    hid_tx_service(KBD_EP);
+    hid_tx_service(CONSUMER_EP);
+    hid_tx_service(SYSTEM_EP);
+    c2_tx_service();
+    CyExitCriticalSection(enableInterrupts);
+}
+
+void USB_EP_1_ISR_ExitCallback(void)
+{
+    hid_tx_service(KBD_EP);
+}
+
+void USB_EP_2_ISR_ExitCallback(void)
+{
+    hid_tx_service(CONSUMER_EP);
+}
+
+void USB_EP_3_ISR_ExitCallback(void)
+{
+    hid_tx_service(SYSTEM_EP);
+}
+
+void USB_EP_8_ISR_ExitCallback(void)
+{
+    c2_tx_service();
 }
 
 void update_keyboard_mods(uint8_t mods)
@@ -181,7 +859,7 @@ inline void keyboard_press(uint8_t keycode)
     {
         if (keyboard_report.keys[cur_pos] == keycode)
         {
-            xprintf("Existing %d pos %d", keycode, cur_pos);
+            xlog(LOG_KEY_EXISTS, keycode, cur_pos);
             return;
         }
         else if (keyboard_report.keys[cur_pos] == 0)
@@ -239,7 +917,7 @@ void update_keyboard_report(queuedScancode *key)
     {
         // on rollover error ALL keys must report ERO.
         memset(KBD_OUTBOX+2, USBCODE_ERO, KBD_KRO_LIMIT);
-        xprintf("Keyboard rollover error");
+        xlog(LOG_KRO);
     }
     USB_SEND_REPORT(KBD);
 }
@@ -272,7 +950,7 @@ static inline void consumer_press(uint16_t keycode)
     {
         if (consumer_report[cur_pos] == keycode)
         {
-            xprintf("Existing %d pos %d", keycode, cur_pos);
+            xlog(LOG_KEY_EXISTS, keycode, cur_pos);
             break;
         }
         else if (consumer_report[cur_pos] == 0)
@@ -372,6 +1050,7 @@ void usb_configure(void)
     /* Wait for device to enumerate */
     while (0u == USB_GetConfiguration()) {};
     usb_suspend_monitor_start();
+    usb_tx_kick();
 }
 
 #define RESET_SINGLE(R, O) \
@@ -394,20 +1073,40 @@ void reset_reports(void)
     //xprintf("reports reset");
 }
 
+// Remote wakeup signalling is stepped by main loop, so scanning goes on while it's in progress.
+enum wakeupPhases {
+    WAKEUP_IDLE = 0,
+    WAKEUP_PENDING,
+    WAKEUP_SIGNALLING,
+    WAKEUP_HOLD,
+};
+static uint8_t wakeup_phase;
+static uint32_t wakeup_deadline;
+static uint32_t wakeup_start;
+static uint32_t suspend_start;
+// Set when resume is detected, wake() measures against it.
+static volatile uint32_t resume_start_cycles;
+
 void nap(void)
 {
     // TODO reconfigure monitor period to provide periodic wakeups for monitor-in-suspend
     usb_suspend_monitor_stop();
+    save_config_flush();
     uint8_t rwu = USB_RWUEnabled();
     USB_Suspend();
+    suspend_start = systime;
+    power_perf.suspends++;
+    scan_suspend(rwu != 0);
     if (rwu == 0)
     {
         power_state = DEVSTATE_SLEEP;
+        trace(TRACE_POWER_STATE, power_state, 0);
         CyPmAltAct(PM_ALT_ACT_TIME_NONE, PM_ALT_ACT_SRC_NONE);
     }
     else
     {
         power_state = DEVSTATE_WATCH;
+        trace(TRACE_POWER_STATE, power_state, 0);
         //SetFreq hangs us dry.
         //CyIMO_SetFreq(CY_IMO_FREQ_24MHZ);
 // CyFlash_SetWaitCycles(3);
@@ -417,30 +1116,81 @@ void nap(void)
 
 void wake(void)
 {
+    // Host resume signalling that follows our own remote wakeup lands here too - that's not a new resume.
+    bool resumed = (wakeup_phase == WAKEUP_IDLE || power_state == DEVSTATE_WATCH);
     USB_Resume();
+    scan_resume();
     power_state = DEVSTATE_FULL_THROTTLE;
+    trace(TRACE_POWER_STATE, power_state, 0);
     scan_start();
-    usb_suspend_monitor_start();
+    if (wakeup_phase == WAKEUP_IDLE)
+    {
+        // Remote wakeup restarts monitor when it's done signalling.
+        usb_suspend_monitor_start();
+        power_perf.hostResumes++;
+    }
+    usb_tx_kick();
     //CyIMO_SetFreq(CY_IMO_FREQ_USB);
+    if (!resumed)
+    {
+        return;
+    }
+    uint32_t resume_us = (PERF_CYCLES() - resume_start_cycles) / (BCLK__BUS_CLK__KHZ / 1000);
+    power_perf.resumeUsLast = resume_us;
+    if (resume_us > power_perf.resumeUsMax)
+    {
+        power_perf.resumeUsMax = resume_us;
+    }
+    power_perf.lastSuspendMs = systime - suspend_start;
+    power_perf.firstKeyMs = UINT16_MAX;
+    resume_time = systime;
 }
 
 void usb_send_wakeup(void)
 {
-    CyDelay(5); // Just in case, not to violate spec by waking immediately.
+    resume_start_cycles = PERF_CYCLES();
+    wakeup_start = systime;
+    power_perf.remoteWakeups++;
+    wakeup_phase = WAKEUP_PENDING;
+    // Not to violate spec by signalling right after suspend - bus must be idle for 5ms.
+    wakeup_deadline = suspend_start + 5;
     wake();
     usb_suspend_monitor_stop();
-    USB_Force(USB_FORCE_K);
-    CyDelay(5);
-    USB_Force(USB_FORCE_NONE);
-    /*
-     * Host must send resume for at least 20ms (USB 2.0 spec 7.1.7.7).
-     * So, 15 more.
-     * We also officially have 10ms to wake.
-     * Let's sit here a bit longer
-     * so we don't have to worry about suspend watchdog shutting us down.
-     */
-    CyDelay(15 + 2);
-    usb_suspend_monitor_start();
+    usb_wakeup_step();
+}
+
+// Called every tick at full throttle.
+void usb_wakeup_step(void)
+{
+    if (wakeup_phase == WAKEUP_IDLE || (int32_t)(systime - wakeup_deadline) < 0)
+    {
+        return;
+    }
+    switch (wakeup_phase)
+    {
+        case WAKEUP_PENDING:
+            USB_Force(USB_FORCE_K);
+            wakeup_phase = WAKEUP_SIGNALLING;
+            wakeup_deadline = systime + 5;
+            break;
+        case WAKEUP_SIGNALLING:
+            USB_Force(USB_FORCE_NONE);
+            /*
+             * Host must send resume for at least 20ms (USB 2.0 spec 7.1.7.7).
+             * So, 15 more.
+             * We also officially have 10ms to wake.
+             * Let's wait a bit longer
+             * so we don't have to worry about suspend watchdog shutting us down.
+             */
+            wakeup_phase = WAKEUP_HOLD;
+            wakeup_deadline = systime + 15 + 2;
+            break;
+        case WAKEUP_HOLD:
+            usb_suspend_monitor_start();
+            wakeup_phase = WAKEUP_IDLE;
+            power_perf.wakeupSignalMs = systime - wakeup_start;
+            break;
+    }
 }
 
 CY_ISR(Suspend_ISR)
@@ -457,6 +1207,7 @@ CY_ISR(Suspend_ISR)
     {
         // Suspend is when no activity for 3ms and J (=Dp is high)
         power_state = DEVSTATE_SUSPENDING;
+        trace(TRACE_POWER_STATE, power_state, 0);
     }
     // bus reset while awake is handled by component.
     // suspend state is handled by DP ISR
@@ -471,14 +1222,11 @@ void USB_DP_ISR_EntryCallback(void)
     {
         return;
     }
+    if (power_state != DEVSTATE_FULL_THROTTLE)
+    {
+        resume_start_cycles = PERF_CYCLES();
+    }
     power_state = DEVSTATE_RESUMING;
+    trace(TRACE_POWER_STATE, power_state, 0);
 }
 
-void xprintf(const char *format_p, ...)
-{
-    va_list va;
-    va_start(va, format_p);
-    vsnprintf((char *)outbox.raw, sizeof(outbox), format_p, va);
-    va_end(va);
-    usb_send_c2();
-}
@@ -10,6 +10,9 @@
 #pragma once
 #include "scan.h"
 #include "pipeline.h"
+#include "trace.h"
+#include "xlog.h"
+#include "ext_config.h"
 
 #define SUSPEND_SYSTIMER_DIVISOR 10
 
@@ -23,6 +26,8 @@ enum devicePowerStates {
 
 //Modified by ISR!
 volatile uint8_t power_state;
+// systime of last resume, for power_perf.firstKeyMs.
+uint32_t resume_time;
 
 /*
  * Internal state storage. Must be longer than conceivable number of simultaneously pressed keys.
@@ -51,10 +56,28 @@ void nap(void);
 void wake(void);
 
 void usb_send_c2();
+void perf_init(void);
 void usb_send_wakeup(void);
+void usb_wakeup_step(void);
 void process_msg(OUT_c2packet_t *);
+/*
+ * Two config slots, newest one with good CRC wins at boot. Slot 0 is EEPROM, slot 1 is flash
+ * right below bootloader metadata row. Bootloader neither checksums nor rewrites flash past
+ * the application image - just make sure the image never grows into this.
+ */
+#define CONFIG_SLOTS 2
+#define CONFIG_SLOT_EEPROM 0
+#define CONFIG_SLOT_FLASH 1
+#define CONFIG_FLASH_BASE (CYDEV_FLASH_BASE + CYDEV_FLASH_SIZE - CYDEV_FLS_ROW_SIZE - EEPROM_BYTESIZE)
+// Extended config right below it. Same rules.
+#define EXT_CONFIG_FLASH_BASE (CONFIG_FLASH_BASE - EXT_CONFIG_BYTESIZE)
+
 void load_config(void);
+uint16_t crc16(const uint8_t *data, uint16_t size);
+void save_config_step(void);
+void save_config_flush(void);
 void apply_config(void);
+void apply_staged_config(OUT_c2packet_t *inbox);
 
 void reset_reports();
 void update_keyboard_report(queuedScancode *key);
@@ -68,7 +91,21 @@ void update_system_report(queuedScancode *key);
 #define _WIPE_OUTBOX(OUTBOX)
 #endif
 
-// Wait for EP - stop waiting if suspend looms.
-#define USB_WAIT_FOR_IN_EP(EP) while (USB_GetEPState(EP) != USB_IN_BUFFER_EMPTY) { if (power_state != DEVSTATE_FULL_THROTTLE) return; }
+/*
+ * Nothing waits for IN endpoints. If endpoint is busy, report goes to per-endpoint queue
+ * and is loaded from endpoint ISR when host picks up the previous one.
+ * HID reports are state - queue holds only the latest one.
+ * Control channel packets are messages - queue is FIFO, C2_TX_QUEUE_SIZE deep, overflow is dropped.
+ */
+#define HID_TX_MAX_REPORT 64
+// Must be power of 2. Matrix stream needs up to MATRIX_ROWS packets per frame.
+#define C2_TX_QUEUE_SIZE 16
+#define C2_TX_QUEUE_NEXT(X) ((X + 1) & (C2_TX_QUEUE_SIZE - 1))
+
+#define USB_SEND_REPORT(TYPE) _WIPE_OUTBOX(TYPE##_OUTBOX); usb_send_report(TYPE##_EP, TYPE##_OUTBOX, OUTBOX_SIZE(TYPE##_OUTBOX)); perf.reports##TYPE++; trace(TRACE_REPORT, TYPE##_EP, 0);
 
-#define USB_SEND_REPORT(TYPE) USB_WAIT_FOR_IN_EP(TYPE##_EP); _WIPE_OUTBOX(TYPE##_OUTBOX); USB_LoadInEP(TYPE##_EP, TYPE##_OUTBOX, OUTBOX_SIZE(TYPE##_OUTBOX));
+void usb_send_report(uint8_t ep, uint8_t *report, uint8_t size);
+bool usb_c2_idle(void);
+uint8_t usb_c2_free(void);
+void usb_c2_flush(void);
+void usb_tx_kick(void);
@@ -0,0 +1,20 @@
+/*
+ * Generated by misc/board_gen.py from misc/boards/f122.board - do not edit, change the profile instead.
+ */
+#pragma once
+
+#define BOARD_NAME "f122"
+#define SWITCH_TYPE BUCKLING_SPRING
+#define MATRIX_ROWS 8
+#define MATRIX_COLS 16
+#define MATRIX_LAYERS 4
+
+// PTK/DMA layout. TopDesign mux and Count7 period must match - PSoC Creator won't regenerate those.
+#define BOARD_ADC_CHANNELS 8
+#define BOARD_PTK_CHANNELS 19
+#define BOARD_ADC_BUF_INITIAL_OFFSET 1
+#define BOARD_ADC_BUF_INTER_ROW_GAP 3
+
+// Scan kernel - columns process_row unrolls, in scan order. Unused columns are not there at all.
+#define BOARD_SCAN_COLUMNS(X) X(15) X(14) X(13) X(12) X(11) X(10) X(9) X(8) X(7) X(6) X(5) X(4) X(3) X(2) X(1) X(0)
+#define BOARD_UNUSED_COLUMNS 0x00000000ul
@@ -0,0 +1,68 @@
+/*
+ *
+ * Copyright (C) 2017 DMA <dma@ya.ru>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation. 
+*/
+
+#pragma once
+#include <stdint.h>
+
+/*
+ * Code-division drive math. No hardware here - misc/cdm_check.c runs the very same code on recorded data.
+ * Includer defines MATRIX_ROWS, MATRIX_COLS and COMMONSENSE_CDM_ROWS_LOG2.
+ */
+
+// Sylvester-Hadamard: H[k][r] = (-1)^popcount(k & r). Drive rows where it's +1.
+static inline void cdm_build_patterns(uint8_t *patterns)
+{
+    for (uint8_t k = 0; k < MATRIX_ROWS; k++)
+    {
+        patterns[k] = 0;
+        for (uint8_t r = 0; r < MATRIX_ROWS; r++)
+        {
+            if ((__builtin_popcount(k & r) & 1) == 0)
+            {
+                patterns[k] |= (1 << r);
+            }
+        }
+    }
+}
+
+/*
+ * Slot k reads y[k] = sum(s[r]) over rows driven in that slot.
+ * Driving is unipolar, so bipolar sums are recovered as z[0] = y[0], z[k] = 2*y[k] - y[0].
+ * H is symmetric and H*H = N*I, so s = H*z / N - which is a fast Walsh-Hadamard transform and a shift.
+ * Every intermediate stays within N * max(s), so 10-bit readouts over 8 rows fit int16.
+ */
+static inline void cdm_decode_values(int16_t values[MATRIX_ROWS][MATRIX_COLS])
+{
+    for (uint8_t col = 0; col < MATRIX_COLS; col++)
+    {
+        int16_t all_rows = values[0][col];
+        for (uint8_t k = 1; k < MATRIX_ROWS; k++)
+        {
+            values[k][col] = 2 * values[k][col] - all_rows;
+        }
+        for (uint8_t h = 1; h < MATRIX_ROWS; h <<= 1)
+        {
+            for (uint8_t i = 0; i < MATRIX_ROWS; i += (h << 1))
+            {
+                for (uint8_t j = i; j < i + h; j++)
+                {
+                    int16_t a = values[j][col];
+                    int16_t b = values[j + h][col];
+                    values[j][col] = a + b;
+                    values[j + h][col] = a - b;
+                }
+            }
+        }
+        // Round, not floor - noisy sums would otherwise read half a count low on average.
+        for (uint8_t k = 0; k < MATRIX_ROWS; k++)
+        {
+            values[k][col] = (values[k][col] + (1 << (COMMONSENSE_CDM_ROWS_LOG2 - 1))) >> COMMONSENSE_CDM_ROWS_LOG2;
+        }
+    }
+}
@@ -0,0 +1,43 @@
+/*
+ *
+ * Copyright (C) 2017 DMA <dma@ya.ru>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation. 
+*/
+
+#pragma once
+#include <stdint.h>
+
+/*
+ * Logical to physical column mapping, see columnMap in c2/nvram.h. No hardware here -
+ * misc/column_map_check.c runs the very same code. Includer defines MATRIX_COLS, PHYSICAL_COLS
+ * and EMPTY_FLASH_BYTE.
+ */
+
+// Physical channel logical column is read from, EMPTY_FLASH_BYTE if it's not connected.
+static inline uint8_t column_map_physical(const uint8_t *map, uint8_t col)
+{
+    if (map[0] == EMPTY_FLASH_BYTE)
+    {
+        return col;
+    }
+    return (map[col] < PHYSICAL_COLS) ? map[col] : EMPTY_FLASH_BYTE;
+}
+
+/*
+ * First entry that is neither "not connected" nor a physical channel the board has - MATRIX_COLS if none.
+ * Physical numbers go up to PHYSICAL_COLS - 1, which is past MATRIX_COLS on uneven ADC split.
+ */
+static inline uint8_t column_map_bad_entry(const uint8_t *map)
+{
+    for (uint8_t col = 0; map[0] != EMPTY_FLASH_BYTE && col < MATRIX_COLS; col++)
+    {
+        if (map[col] != EMPTY_FLASH_BYTE && map[col] >= PHYSICAL_COLS)
+        {
+            return col;
+        }
+    }
+    return MATRIX_COLS;
+}
@@ -0,0 +1,117 @@
+/*
+ *
+ * Copyright (C) 2017 DMA <dma@ya.ru>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation. 
+*/
+#include <project.h>
+#include <stddef.h>
+#include "PSoC_USB.h"
+#include "ext_config.h"
+
+#define EXT_BLOCKS_PER_ROW (CYDEV_FLS_ROW_SIZE / EXT_CONFIG_BLOCK_SIZE)
+#define EXT_NO_ROW 0xff
+
+#if EXT_BLOCKS_PER_ROW > 8
+#error "Upload row tracking is a byte - make blocks bigger"
+#endif
+
+// Flash row being assembled from upload blocks, bit per block received.
+static uint8_t ext_row_buffer[CYDEV_FLS_ROW_SIZE];
+static uint8_t ext_row = EXT_NO_ROW;
+static uint8_t ext_row_blocks;
+
+void ext_config_check(void)
+{
+    ext_config_valid = ext_config.extVersion == EXT_CONFIG_VERSION
+        && ext_config.extLayerCount <= EXT_LAYERS_MAX
+        && ext_config.extCrc == crc16(ext_config.raw, offsetof(ext_config_t, extCrc));
+}
+
+/*
+ * Writes assembled row, blocks host didn't send keep what flash has.
+ * Blocking - this is config upload, scanning goes on in ISRs anyway.
+ */
+void ext_config_flush(void)
+{
+    if (ext_row == EXT_NO_ROW)
+    {
+        return;
+    }
+    for (uint8_t i = 0; i < EXT_BLOCKS_PER_ROW; i++)
+    {
+        if ((ext_row_blocks & (1 << i)) == 0)
+        {
+            memcpy(
+                ext_row_buffer + i * EXT_CONFIG_BLOCK_SIZE,
+                ext_config.raw + ext_row * CYDEV_FLS_ROW_SIZE + i * EXT_CONFIG_BLOCK_SIZE,
+                EXT_CONFIG_BLOCK_SIZE
+            );
+        }
+    }
+    // SPC may be busy committing config.
+    save_config_flush();
+    uint32_t address = EXT_CONFIG_FLASH_BASE + ext_row * CYDEV_FLS_ROW_SIZE;
+    CySetTemp();
+    CyWriteRowData(
+        CY_SPC_FIRST_FLASH_ARRAYID + address / CYDEV_FLS_SECTOR_SIZE,
+        (address % CYDEV_FLS_SECTOR_SIZE) / CYDEV_FLS_ROW_SIZE,
+        ext_row_buffer
+    );
+    CyFlushCache();
+    ext_row = EXT_NO_ROW;
+    ext_row_blocks = 0;
+    ext_config_check();
+}
+
+void ext_config_receive_block(OUT_c2packet_t *inbox)
+{
+    uint8_t block = inbox->payload[0];
+    if (block >= EXT_CONFIG_BLOCKS)
+    {
+        return;
+    }
+    uint8_t row = block / EXT_BLOCKS_PER_ROW;
+    if (row != ext_row)
+    {
+        ext_config_flush();
+        ext_row = row;
+    }
+    memcpy(ext_row_buffer + (block % EXT_BLOCKS_PER_ROW) * EXT_CONFIG_BLOCK_SIZE, inbox->payload + 1, EXT_CONFIG_BLOCK_SIZE);
+    ext_row_blocks |= 1 << (block % EXT_BLOCKS_PER_ROW);
+    if (ext_row_blocks == (1 << EXT_BLOCKS_PER_ROW) - 1)
+    {
+        ext_config_flush();
+    }
+    memset(outbox.raw, 0, sizeof(outbox));
+    outbox.response_type = C2RESPONSE_EXT_CONFIG;
+    outbox.payload[0] = block;
+    usb_send_c2();
+}
+
+void ext_config_send_block(OUT_c2packet_t *inbox)
+{
+    uint8_t block = inbox->payload[0];
+    if (block >= EXT_CONFIG_BLOCKS)
+    {
+        return;
+    }
+    ext_config_flush();
+    memset(outbox.raw, 0, sizeof(outbox));
+    outbox.response_type = C2RESPONSE_EXT_CONFIG;
+    outbox.payload[0] = block;
+    memcpy(outbox.payload + 1, ext_config.raw + block * EXT_CONFIG_BLOCK_SIZE, EXT_CONFIG_BLOCK_SIZE);
+    usb_send_c2();
+}
+
+// Keymap for a layer past MATRIX_LAYERS, NULL if there's no such layer.
+const uint8_t *ext_config_layer(uint8_t layer)
+{
+    if (!ext_config_valid || layer < MATRIX_LAYERS || layer - MATRIX_LAYERS >= ext_config.extLayerCount)
+    {
+        return NULL;
+    }
+    return ext_config.layers[layer - MATRIX_LAYERS];
+}
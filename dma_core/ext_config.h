@@ -0,0 +1,22 @@
+/*
+ *
+ * Copyright (C) 2017 DMA <dma@ya.ru>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation. 
+*/
+
+#pragma once
+#include "globals.h"
+
+// Memory-mapped, read it directly. Only trust it when ext_config_valid is set.
+#define ext_config (*(const ext_config_t *)EXT_CONFIG_FLASH_BASE)
+
+bool ext_config_valid;
+
+void ext_config_check(void);
+void ext_config_flush(void);
+void ext_config_receive_block(OUT_c2packet_t *inbox);
+void ext_config_send_block(OUT_c2packet_t *inbox);
+const uint8_t *ext_config_layer(uint8_t layer);
@@ -9,24 +9,18 @@
 
 #pragma once
 // LIB.H!!!
-#define FORCE_BIT(VAR, BN, TO) ((VAR & (!(1<<BN))) + (TO << BN))
+#define FORCE_BIT(VAR, BN, TO) ((VAR & (~(1<<BN))) + (TO << BN))
 #define BEAMSPRING 0
 #define BUCKLING_SPRING 1
 // /LIB.H!!!
 
-// Do not touch above definitions. To change switch type change this.
-#define SWITCH_TYPE BUCKLING_SPRING
+// Do not touch above definitions. Switch type, matrix size and scan kernel come from board profile -
+// see misc/boards and misc/board_gen.py.
+#include "board.h"
 
 // Main safety switch
 #define NOT_A_KEYBOARD 0
 
-/*
- * ODD NUMBER OF COLUMNS DO NOT MIX WITH DUAL ADCs!!! See scan.c!
- */
-#define MATRIX_COLS 16
-#define MATRIX_ROWS 8
-#define MATRIX_LAYERS 4
-
 #include "c2/c2_protocol.h"
 #include "c2/nvram.h"
 
@@ -76,6 +70,8 @@ IN_c2packet_t outbox;
 
 // EEPROM stuff
 psoc_eeprom_t config;
+// Host uploads land here. C2CMD_APPLY_CONFIG swaps it into config, C2CMD_COMMIT writes it to EEPROM.
+psoc_eeprom_t config_staging;
 
 typedef struct {
     bool emergency_stop;
@@ -92,7 +88,12 @@ volatile uint32_t systime;
 status_register_t status_register;
 uint8_t led_status;
 
-void xprintf(const char *format_p, ...);
+//Modified by ISR! See C2CMD_GET_PERF.
+perf_counters_t perf;
+power_counters_t power_perf;
+scan_integrity_t scan_integrity;
+// DWT cycle counter, enabled by perf_init.
+#define PERF_CYCLES() (DWT->CYCCNT)
 
 #if SWITCH_TYPE == BEAMSPRING
 #define NORMALLY_LOW 0
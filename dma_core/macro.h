@@ -0,0 +1,147 @@
+/*
+ *
+ * Copyright (C) 2017 DMA <dma@ya.ru>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation. 
+*/
+
+#pragma once
+#include <stdint.h>
+
+/*
+ * Macro bytecode interpreter. No hardware here - misc/macro_check.c runs the very same code on sample macros.
+ * Includer provides queue_usbcode(), lookup_macro_where(), config.delayLib and systime,
+ * plus MACRO_OP_*, USBQUEUE_RELEASED_MASK and MACRO_KEY_UPDOWN_RELEASE.
+ */
+
+// Presses or releases every modifier in the bitmap.
+inline void queue_mods(uint32_t time, uint8_t flags, uint8_t modmap)
+{
+    for (uint8_t i = 0; modmap != 0; i++, modmap >>= 1)
+    {
+        if (modmap & 1)
+        {
+            queue_usbcode(time, flags, 0xe0 + i);
+        }
+    }
+}
+
+typedef struct {
+    const uint8_t *ptr;
+    const uint8_t *end;
+    uint8_t held_mods; // Released when subroutine called from this frame returns.
+} macro_frame_t;
+
+/*
+ * Bytecode is interpreted in place - subroutine calls push a frame, nothing gets expanded to RAM.
+ * See MACRO_OP_* for the format.
+ */
+inline void play_macro(const uint8_t *macro)
+{
+    macro_frame_t frames[MACRO_CALL_DEPTH + 1];
+    uint8_t depth = 0;
+    frames[0].ptr = macro + 3;
+    frames[0].end = frames[0].ptr + macro[2];
+    frames[0].held_mods = 0;
+    uint32_t now = systime;
+    uint_fast16_t run_delay = config.delayLib[DELAYS_EVENT];
+    uint_fast16_t delay;
+    uint8_t wrap_mods = 0;
+    for (;;)
+    {
+        macro_frame_t *f = &frames[depth];
+        if (f->ptr >= f->end)
+        {
+            if (depth == 0)
+            {
+                break;
+            }
+            depth--;
+            queue_mods(now, USBQUEUE_RELEASED_MASK, frames[depth].held_mods);
+            frames[depth].held_mods = 0;
+            continue;
+        }
+        uint8_t op = *f->ptr++;
+        uint8_t mods = wrap_mods;
+        wrap_mods = 0;
+        // Every opcode except end carries at least one operand byte, except run delay.
+        uint8_t operands = ((op & 0xc0) == MACRO_OP_RUN) ? (op & 0x3f) + 1 : 1;
+        if ((op & 0xf0) == MACRO_OP_RUN_DELAY)
+        {
+            operands = 0;
+        }
+        if (f->end - f->ptr < operands || (op & 0xf0) == MACRO_OP_END)
+        {
+            // Truncated or finished - stop this macro, whatever the depth. Callers' wraps go up too.
+            queue_mods(now, USBQUEUE_RELEASED_MASK, mods);
+            while (depth > 0)
+            {
+                depth--;
+                queue_mods(now, USBQUEUE_RELEASED_MASK, frames[depth].held_mods);
+                frames[depth].held_mods = 0;
+            }
+            frames[0].ptr = frames[0].end;
+            continue;
+        }
+        switch (op & 0xc0)
+        {
+            case MACRO_OP_TYPE:
+                // Press+release, timing from delayLib
+                delay = config.delayLib[(op >> 2) & 0x0f];
+                queue_usbcode(now, 0, *f->ptr);
+                now += delay;
+                queue_usbcode(now, USBQUEUE_RELEASED_MASK, *f->ptr);
+                f->ptr++;
+                break;
+            case MACRO_OP_PRESS:
+                // Press or release
+                queue_usbcode(now, (op & MACRO_KEY_UPDOWN_RELEASE) ? USBQUEUE_RELEASED_MASK : 0, *f->ptr);
+                f->ptr++;
+                break;
+            case MACRO_OP_RUN:
+                // Run of plain keys
+                for (uint8_t i = 0; i < operands; i++)
+                {
+                    queue_usbcode(now, 0, *f->ptr);
+                    now += run_delay;
+                    queue_usbcode(now, USBQUEUE_RELEASED_MASK, *f->ptr);
+                    f->ptr++;
+                }
+                break;
+            default:
+                switch (op & 0xf0)
+                {
+                    case MACRO_OP_RUN_DELAY:
+                        run_delay = config.delayLib[op & 0x0f];
+                        break;
+                    case MACRO_OP_WRAP:
+                        // Mods stay down for the next instruction. Wraps don't stack - outer mods go up now.
+                        queue_mods(now, USBQUEUE_RELEASED_MASK, mods);
+                        mods = 0;
+                        wrap_mods = *f->ptr++;
+                        queue_mods(now, 0, wrap_mods);
+                        break;
+                    case MACRO_OP_CALL:
+                    {
+                        const uint8_t *sub = lookup_macro_where(MACRO_TYPE_SUBROUTINE, MACRO_TYPE_SUBROUTINE, *f->ptr);
+                        f->ptr++;
+                        if (sub != NULL && depth < MACRO_CALL_DEPTH)
+                        {
+                            f->held_mods = mods;
+                            mods = 0;
+                            depth++;
+                            frames[depth].ptr = sub + 3;
+                            frames[depth].end = sub + 3 + sub[2];
+                            frames[depth].held_mods = 0;
+                        }
+                        break;
+                    }
+                }
+                break;
+        }
+        queue_mods(now, USBQUEUE_RELEASED_MASK, mods);
+    }
+    queue_mods(now, USBQUEUE_RELEASED_MASK, wrap_mods);
+}
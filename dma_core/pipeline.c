@@ -48,28 +48,59 @@ inline void process_layerMods(uint8_t sc, uint8_t keycode)
 
 /*
  * Data structure: [scancode][flags][data length][macro data]
+ * Entry matches when its flags masked with flags_mask equal flags_match.
  */
-inline uint_fast16_t lookup_macro(uint8_t flags, uint8_t keycode)
+inline const uint8_t *lookup_macro_in(const uint8_t *macros, uint_fast16_t size, uint8_t flags_mask, uint8_t flags_match, uint8_t keycode)
 {
     uint_fast16_t ptr = 0;
     do
     {
-#if USBQUEUE_RELEASED_MASK != MACRO_TYPE_ONKEYUP
-#error Please rewrite check below - it is no longer valid
-#endif
         if (
-            config.macros[ptr] == keycode
-         && (flags & USBQUEUE_RELEASED_MASK) == (config.macros[ptr+1] & MACRO_TYPE_ONKEYUP)
+            macros[ptr] == keycode
+         && (macros[ptr+1] & flags_mask) == flags_match
         )
         {
-            return ptr;
+            return &macros[ptr];
         }
         else
         {
-            ptr += config.macros[ptr+2] + 3;
+            ptr += macros[ptr+2] + 3;
         }
-    } while ( ptr < sizeof config.macros && config.macros[ptr] != EMPTY_FLASH_BYTE );
-    return MACRO_NOT_FOUND;
+    } while ( ptr < size && macros[ptr] != EMPTY_FLASH_BYTE );
+    return NULL;
+}
+
+// EEPROM macros first, then extended config ones.
+inline const uint8_t *lookup_macro_where(uint8_t flags_mask, uint8_t flags_match, uint8_t keycode)
+{
+    const uint8_t *macro = lookup_macro_in(config.macros, sizeof config.macros, flags_mask, flags_match, keycode);
+    if (macro == NULL && ext_config_valid)
+    {
+        macro = lookup_macro_in(ext_config.macros, sizeof ext_config.macros, flags_mask, flags_match, keycode);
+    }
+    return macro;
+}
+
+inline const uint8_t *lookup_macro(uint8_t flags, uint8_t keycode)
+{
+#if USBQUEUE_RELEASED_MASK != MACRO_TYPE_ONKEYUP
+#error Please rewrite check below - it is no longer valid
+#endif
+    return lookup_macro_where(
+        MACRO_TYPE_ONKEYUP | MACRO_TYPE_SUBROUTINE,
+        flags & USBQUEUE_RELEASED_MASK,
+        keycode
+    );
+}
+
+inline uint8_t layer_keycode(uint8_t layer, uint8_t sc)
+{
+    if (layer < MATRIX_LAYERS)
+    {
+        return config.layers[layer][sc];
+    }
+    const uint8_t *keymap = ext_config_layer(layer);
+    return keymap ? keymap[sc] : USBCODE_TRANSPARENT;
 }
 
 inline void queue_usbcode(uint32_t time, uint8_t flags, uint8_t keycode)
@@ -85,39 +116,17 @@ inline void queue_usbcode(uint32_t time, uint8_t flags, uint8_t keycode)
     USBQueue[USBQueue_writepos].sysTime = time;
     USBQueue[USBQueue_writepos].flags = flags;
     USBQueue[USBQueue_writepos].keycode = keycode;
-}
-
-inline void play_macro(uint_fast16_t macro_start)
-{
-    uint8_t *mptr = &config.macros[macro_start] + 3;
-    uint8_t *macro_end = mptr + config.macros[macro_start + 2];
-    uint32_t now = systime;
-    uint_fast16_t delay;
-    uint8_t keyflags;
-    while(mptr <= macro_end)
+    trace(TRACE_QUEUE, keycode, flags);
+    uint8_t span = ((USBQueue_writepos - USBQueue_readpos) & KEYCODE_BUFFER_END) + 1;
+    if (span > perf.usbQueueHighWater)
     {
-        switch (*mptr >> 6)
-        {
-            case 0:
-                // Press+release, timing from delayLib
-                delay = config.delayLib[(*mptr >> 2) & 0x0f];
-                mptr++;
-                queue_usbcode(now, 0, *mptr);
-                now += delay;
-                queue_usbcode(now, USBQUEUE_RELEASED_MASK, *mptr);
-                break;
-            case 1:
-                // Press or release
-                keyflags = (*mptr & MACRO_KEY_UPDOWN_RELEASE) ? USBQUEUE_RELEASED_MASK : 0;
-                mptr++;
-                queue_usbcode(now, keyflags, *mptr);
-                break;
-            default: return;
-        }
-        mptr++;
+        perf.usbQueueHighWater = span;
     }
 }
 
+// Needs queue_usbcode and lookup_macro_where from above.
+#include "macro.h"
+
 inline uint8_t process_scancode_buffer(void)
 {
     if (scancode_buffer_readpos == scancode_buffer_writepos)
@@ -129,7 +138,7 @@ inline uint8_t process_scancode_buffer(void)
     }
     uint8_t scancode = scancode_buffer[scancode_buffer_readpos];
 #ifdef MATRIX_LEVELS_DEBUG
-    xprintf("sc: %d %d @ %d ms, lvl %d/%d", scancode & KEY_UP_MASK, scancode & SCANCODE_MASK, systime, level_buffer[scancode_buffer_readpos], level_buffer_inst[scancode_buffer_readpos]);
+    xlog(LOG_SCANCODE_LEVELS, scancode & KEY_UP_MASK, scancode & SCANCODE_MASK, systime, level_buffer[scancode_buffer_readpos], level_buffer_inst[scancode_buffer_readpos]);
 #else
     //xprintf("sc: %d %d @ %d ms", scancode & KEY_UP_MASK, scancode &SCANCODE_MASK, systime);
 #endif
@@ -170,6 +179,11 @@ inline void process_real_key(void)
         }
         return;
     }
+    trace(TRACE_KEY, sc, 0);
+    if (power_perf.firstKeyMs == UINT16_MAX)
+    {
+        power_perf.firstKeyMs = systime - resume_time;
+    }
     if (status_register.setup_mode)
     {
         outbox.response_type = C2RESPONSE_SCANCODE;
@@ -178,9 +192,9 @@ inline void process_real_key(void)
         return;
     }
     // Resolve USB keycode using current active layers
-    for (uint8_t i=currentLayer; i >= 0; i--)
+    for (int8_t i=currentLayer; i >= 0; i--)
     {
-        usb_sc = config.layers[i][sc & SCANCODE_MASK];
+        usb_sc = layer_keycode(i, sc & SCANCODE_MASK);
         if (usb_sc != USBCODE_TRANSPARENT)
         {
             break;
@@ -203,10 +217,10 @@ TODO resolve problem where pressed mod keys are missing on the new layer.
 */
     }
     uint8_t keyflags = (sc & USBQUEUE_RELEASED_MASK) | USBQUEUE_REAL_KEY_MASK;
-    uint_fast16_t macro_ptr = lookup_macro(keyflags, usb_sc);
-    bool do_play = (macro_ptr != MACRO_NOT_FOUND);
+    const uint8_t *macro = lookup_macro(keyflags, usb_sc);
+    bool do_play = (macro != NULL);
     bool do_queue = !do_play; // eat the macro-producing code.
-    if (do_play && (sc & USBQUEUE_RELEASED_MASK) && (config.macros[macro_ptr+1] & MACRO_TYPE_TAP))
+    if (do_play && (sc & USBQUEUE_RELEASED_MASK) && (macro[1] & MACRO_TYPE_TAP))
     {
         // Tap macro. Check if previous event was this key down and it's not too late.
         do_queue = true;
@@ -224,7 +238,7 @@ NOTE2: we still want to maintain order?
     Otherwise linked list is probably what's doctor ordered (though expensive at 4B per pointer plus memory management)
 */
     if (do_queue) queue_usbcode(systime, keyflags, usb_sc);
-    if (do_play) play_macro(macro_ptr);
+    if (do_play) play_macro(macro);
     return;
 }
 
@@ -324,14 +338,16 @@ inline void pipeline_process(void)
 
 inline bool pipeline_process_wakeup(void)
 {
-    uint8 sc = process_scancode_buffer();
-    if (sc == COMMONSENSE_NOKEY)
-    {
-        return false;
-    }
-    if ((sc & KEY_UP_MASK) == 0)
+    uint8 sc;
+    while ((sc = process_scancode_buffer()) != COMMONSENSE_NOKEY)
     {
-        return true;
+        if ((sc & KEY_UP_MASK) == 0 && scan_is_wake_key(sc))
+        {
+            scan_watch_log_wake(sc);
+            // Keypress that woke the host goes to it as well.
+            push_back_scancode(sc);
+            return true;
+        }
     }
     return false;
 }
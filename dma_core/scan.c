@@ -11,6 +11,8 @@
 #include "PSoC_USB.h"
 
 #include "scan.h"
+#include "cdm.h"
+#include "column_map.h"
 
 CY_ISR_PROTO(EoC_ISR);
 CY_ISR_PROTO(Result_ISR);
@@ -23,13 +25,101 @@ static uint8_t FinalBufTD[2];
 static int16_t BufMem[PTK_CHANNELS * NUM_ADCs];
 static int16_t Results[ADC_CHANNELS * 2 * NUM_ADCs];
 static uint8_t reading_row, driving_row;
+// Row order within a pass, stepped by EoC_ISR. Hot rows appear more than once.
+static uint8_t scan_schedule[MATRIX_ROWS * HOT_ROW_RATE_MAX];
+static volatile uint8_t scan_schedule_length;
+// Times each row appears in the schedule. Hot rows take 1/rate filter step per sample, remainder carried
+// in iir_carry - wall-clock time constant stays the same as for the rest of the matrix.
+static uint8_t row_rate[MATRIX_ROWS];
+static int8_t iir_carry[MATRIX_ROWS][MATRIX_COLS];
+static uint8_t scan_slot;
+static volatile bool reading_pass_end;
 static bool scan_in_progress;
 static uint32_t matrix_status[MATRIX_ROWS];
 static bool matrix_was_active;
+// Key health tracking. Bit per column, like matrix_status.
+static uint32_t key_quarantine[MATRIX_ROWS];
+static uint32_t key_held_whole_window[MATRIX_ROWS];
+static uint8_t key_events[MATRIX_ROWS][MATRIX_COLS];
+static uint8_t key_stuck_windows[MATRIX_ROWS][MATRIX_COLS];
+static uint32_t key_health_window_start;
+static uint16_t scan_passes;
+// Level shift due to die temperature. Written by main loop, read by ISR - int16 store is atomic.
+static int16_t temperature_offset;
+// Scan rate governor. Rate is lowered by main loop, raised back to full by ISR.
+static const uint8_t scan_rate_periods[SCAN_RATES] = SCAN_RATE_PERIODS;
+static volatile uint8_t scan_rate;
+static volatile uint32_t scan_active_time;
+static bool scan_activity;
+static uint8_t scan_rate_countdown;
+static uint16_t scan_rate_residency_ms[SCAN_RATES];
+// Rows driven during a pass. Everything at full throttle, wake key rows in watch.
+static uint32_t scan_row_mask = SCAN_ALL_ROWS;
+// Watch mode. ADCs sleep between passes.
+static volatile bool scan_pass_done;
+static bool scan_adc_asleep;
+static uint32_t scan_watch_pass_start;
+static uint32_t scan_watch_pass_cycles;
+// Rows not scanned during suspend. Their first readout after resume replaces filter state instead of
+// being filtered into it - so stale accumulators don't eat the first keypress.
+static uint32_t scan_stale_rows;
+static volatile uint32_t scan_prime_rows;
+// Row transfer tags. EoC_ISR bumps row_transfer_seq on each copy into Results, Result_ISR must see
+// every tag once - and be done with it before the next conversion ends.
+static volatile uint32_t row_transfer_seq;
+static volatile uint32_t row_processed_seq;
+static uint8_t row_transfer_held;
+static bool scan_pass_faulted;
+static bool scan_window_faulted;
+// Auto-throttle. Conversions each row stays driven for before being read out, on top of the first one.
+static volatile uint8_t scan_slack;
+static uint8_t scan_slack_left;
+// Self-test. Requested by main loop, armed at a pass boundary, counted down by Result_ISR.
+static bool selftest_requested;
+static volatile bool selftest_pending;
+static volatile bool selftest_active;
+static volatile bool selftest_done;
+static uint8_t selftest_passes;
+static volatile uint8_t selftest_passes_done;
+static uint32_t selftest_start_cycles, selftest_cycles;
+static uint32_t selftest_last_readout;
+static uint16_t selftest_faults;
+static selftest_summary_t selftest_summary;
+static struct {
+    uint32_t period_total;
+    uint32_t isr_total;
+    uint16_t isr_max;
+    uint16_t samples;
+} selftest_rows[MATRIX_ROWS];
+static struct {
+    uint16_t min;
+    uint16_t max;
+    uint32_t sum;
+    uint32_t sum_squares;
+    uint8_t saturated;
+} selftest_keys[MATRIX_ROWS][MATRIX_COLS];
 
 static uint16 matrix[MATRIX_ROWS][MATRIX_COLS];
 static uint16 *matrix_ptr = (uint16 *)&matrix;
 
+// Crosstalk table regrouped by victim row, so ISR only looks at relevant entries. Rebuilt by scan_reset.
+static crosstalk_entry_t crosstalk[CROSSTALK_ENTRIES];
+static uint8_t crosstalk_row_start[MATRIX_ROWS + 1];
+
+#ifdef COMMONSENSE_CDM_MODE
+#if (1 << COMMONSENSE_CDM_ROWS_LOG2) != MATRIX_ROWS
+#error "Code-division drive needs MATRIX_ROWS == 2^COMMONSENSE_CDM_ROWS_LOG2"
+#endif
+// Row bitmask driven during each slot. Slot number is what driving_row/reading_row hold in this mode.
+static uint8_t cdm_patterns[MATRIX_ROWS];
+// Raw per-slot readouts, decoded in place into per-row levels at the end of the pass.
+static int16_t cdm_values[MATRIX_ROWS][MATRIX_COLS];
+static uint8_t column_identity[MATRIX_COLS];
+#endif
+// Results index for each logical column - remap costs nothing in the ISR. Built from config.columnMap.
+static uint8_t column_readout[MATRIX_COLS];
+static uint32_t unmapped_columns;
+
 static void InitSensor(void)
 {
     // Init DMA, each burst requires a request 
@@ -94,15 +184,66 @@ static inline void Drive(uint8 drv)
  * reading the row in 4us is pointless if you spend 20us setting drive modes.
 */
     //SetPin should not be used because it doesn't trigger start circuitry
+#ifdef COMMONSENSE_CDM_MODE
+    DriveReg0_Write(cdm_patterns[drv]);
+#else
     DriveReg0_Write(1 << drv);
+#endif
 }
 
 inline void append_scancode(uint8_t scancode)
 {
     if (status_register.emergency_stop)
         return;
+    if (SCANCODE_BUFFER_NEXT(scancode_buffer_writepos) == scancode_buffer_readpos)
+    {
+        // Full. Writing would make it look empty - drop the newest instead.
+        perf.scancodeDrops++;
+        trace(TRACE_SCANCODE, scancode, 1);
+        return;
+    }
+    trace(TRACE_SCANCODE, scancode, 0);
     scancode_buffer_writepos = SCANCODE_BUFFER_NEXT(scancode_buffer_writepos);
     scancode_buffer[scancode_buffer_writepos] = scancode;
+    uint8_t occupancy = (scancode_buffer_writepos - scancode_buffer_readpos) & SCANCODE_BUFFER_END;
+    if (occupancy > perf.scancodeHighWater)
+    {
+        perf.scancodeHighWater = occupancy;
+    }
+}
+
+/*
+ * Row readout couldn't keep up. Called from Result_ISR, or under critical section from EoC_ISR
+ * which Result_ISR preempts.
+ */
+static void scan_fault(uint8_t fault)
+{
+    switch (fault)
+    {
+        case SCAN_FAULT_OVERRUN:
+            scan_integrity.isrOverruns++;
+            break;
+        case SCAN_FAULT_DEFERRED:
+            scan_integrity.transfersDeferred++;
+            break;
+    }
+    scan_integrity.lastFaultMs = systime;
+    if (selftest_active)
+    {
+        selftest_faults++;
+    }
+    scan_pass_faulted = true;
+    scan_window_faulted = true;
+    trace(TRACE_SCAN_FAULT, reading_row, fault);
+    if ((config.capsenseFlags & (1 << CSF_AT)) && scan_slack < SCAN_SLACK_MAX)
+    {
+        scan_slack++;
+        scan_integrity.slack = scan_slack;
+        if (scan_slack > scan_integrity.slackMax)
+        {
+            scan_integrity.slackMax = scan_slack;
+        }
+    }
 }
 
 CY_ISR(EoC_ISR)
@@ -110,27 +251,54 @@ CY_ISR(EoC_ISR)
 #ifdef DEBUG_INTERRUPTS
     PIN_DEBUG(1, 1)
 #endif
-    // If there's no scan in progress - one row will be filled by garbage.
-    // Which is no big deal.
 #ifdef COMMONSENSE_100KHZ_MODE
     Drive(0);
     return;
     // The rest of the code is dead in 100kHz mode.
 #endif
+    if (!scan_in_progress)
+    {
+        // Nothing driven between passes - and ADCs may be asleep. Don't feed garbage to Result_ISR.
+        return;
+    }
+    if (scan_slack_left > 0)
+    {
+        // Throttled - keep the row driven for another conversion.
+        scan_slack_left--;
+        return;
+    }
+    if (row_transfer_seq != row_processed_seq && row_transfer_held < SCAN_TRANSFER_HOLD_MAX)
+    {
+        // Result_ISR hasn't got to previous row - copying now would overwrite it.
+        row_transfer_held++;
+        uint8_t enableInterrupts = CyEnterCriticalSection();
+        scan_fault(SCAN_FAULT_DEFERRED);
+        CyExitCriticalSection(enableInterrupts);
+        return;
+    }
+    row_transfer_held = 0;
+    scan_slack_left = scan_slack;
+    row_transfer_seq++;
+    scan_integrity.rowTransfers++;
     CyDmaChSetRequest(FinalBuf_DmaHandle, CY_DMA_CPU_REQ);
     uint8_t enableInterrupts = CyEnterCriticalSection();
     reading_row = driving_row;
-    if (driving_row == 0)
+    reading_pass_end = (scan_slot + 1 >= scan_schedule_length);
+    if (reading_pass_end)
     {
-        // End of the scan pass. Loop if full throttle, otherwise stop.
-        if (power_state != DEVSTATE_FULL_THROTTLE)
+        // End of the scan pass. Loop if full throttle at full rate, otherwise stop.
+        if (power_state != DEVSTATE_FULL_THROTTLE || scan_rate != 0)
         {
             scan_in_progress = false;
             goto EoC_final; // Important - otherwise interrupts are left disabled!
         }
-        driving_row = MATRIX_ROWS;
+        scan_slot = 0;
+    }
+    else
+    {
+        scan_slot++;
     }
-    driving_row--;
+    driving_row = scan_schedule[scan_slot];
     // Drive row.
     // DMA channel reading out results has priority, so this should not overwrite the results buffer.
     Drive(driving_row);
@@ -139,113 +307,775 @@ EoC_final:
     CyExitCriticalSection(enableInterrupts);
 }
 
-CY_ISR(Result_ISR)
+#ifdef COMMONSENSE_CDM_MODE
+static void cdm_init(void)
 {
-#ifdef DEBUG_INTERRUPTS
-    PIN_DEBUG(1, 2)
+    cdm_build_patterns(cdm_patterns);
+}
+
+static inline void cdm_capture(uint8_t slot)
+{
+    for (uint8_t col = 0; col < MATRIX_COLS; col++)
+    {
+        cdm_values[slot][col] = Results[column_readout[col]];
+    }
+}
+
+static void cdm_decode(void)
+{
+    cdm_decode_values(cdm_values);
+}
 #endif
-#ifdef COMMONSENSE_100KHZ_MODE
-    return;
-    // The rest of the code is dead in 100kHz mode.
+
+static inline void count_key_event(uint8_t row, uint8_t col)
+{
+    if (key_events[row][col] < UINT8_MAX)
+    {
+        key_events[row][col]++;
+    }
+}
+
+static void column_map_init(void)
+{
+    // Columns the board doesn't have are out of the kernel already, keep them out of common mode voting too.
+    unmapped_columns = BOARD_UNUSED_COLUMNS;
+    for (uint8_t col = 0; col < MATRIX_COLS; col++)
+    {
+        uint8_t physical = column_map_physical(config.columnMap, col);
+        if (physical == EMPTY_FLASH_BYTE)
+        {
+            // Not connected. Point it somewhere harmless, key is skipped anyway.
+            unmapped_columns |= (1 << col);
+            physical = 0;
+        }
+        // Grounded channel samples are interleaved in Results.
+        column_readout[col] = physical * 2;
+#ifdef COMMONSENSE_CDM_MODE
+        column_identity[col] = col;
 #endif
-    uint32_t row_status = matrix_status[reading_row];
-    register uint8_t current_col = ADC_CHANNELS * NUM_ADCs;
-    register uint8_t adc_buffer_pos = ADC_CHANNELS * NUM_ADCs * 2;
-    while (current_col > 0)
-    {
-        current_col--;
-        adc_buffer_pos -= 2;
-
-        // Here you need matrix-sized array of uint8!! matrix[][] won't do!!
-        register uint8_t key_index = (uint32)&config.deadBandHi[reading_row][current_col] - (uint32)&config.deadBandHi;
-        register uint8_t hi = config.deadBandHi[reading_row][current_col];
-        register uint8_t lo = config.deadBandLo[reading_row][current_col];
-        register int16_t readout = Results[adc_buffer_pos];
-        if (status_register.matrix_output)
-        {
-            // When monitoring matrix we're interested in raw feed.
-            matrix_ptr[key_index] = readout;
-            continue;
+    }
+}
+
+static void crosstalk_init(void)
+{
+    uint8_t pos = 0;
+    for (uint8_t row = 0; row < MATRIX_ROWS; row++)
+    {
+        crosstalk_row_start[row] = pos;
+        for (uint8_t i = 0; i < CROSSTALK_ENTRIES && config.crosstalk[i].victim != EMPTY_FLASH_BYTE; i++)
+        {
+            if (config.crosstalk[i].victim / MATRIX_COLS == row
+             && config.crosstalk[i].aggressor < COMMONSENSE_MATRIX_SIZE)
+            {
+                crosstalk[pos++] = config.crosstalk[i];
+            }
         }
-        else if (hi == 0)
+    }
+    crosstalk_row_start[MATRIX_ROWS] = pos;
+}
+
+/*
+ * How much neighbours pushed each key of the row, in readout units, sign such that it must be subtracted.
+ * Aggressor excursion is its filtered level beyond the rest-side threshold - zero when it's not pressed.
+ * Returns false if there's nothing to compensate in this row.
+ */
+static inline bool crosstalk_compensation(uint8_t row, int16_t *compensation)
+{
+    if (crosstalk_row_start[row] == crosstalk_row_start[row + 1])
+    {
+        return false;
+    }
+    memset(compensation, 0, MATRIX_COLS * sizeof(compensation[0]));
+    for (uint8_t i = crosstalk_row_start[row]; i < crosstalk_row_start[row + 1]; i++)
+    {
+        uint8_t aggressor = crosstalk[i].aggressor;
+        int16_t level = matrix_ptr[aggressor] >> COMMONSENSE_IIR_ORDER;
+#if NORMALLY_LOW == 1
+        int16_t excursion = level - ((uint8_t *)config.deadBandLo)[aggressor];
+#else
+        int16_t excursion = ((uint8_t *)config.deadBandHi)[aggressor] - level;
+#endif
+        if (excursion <= 0)
         {
             continue;
-        } else if (
-            !(
-                (readout <= lo && readout + config.guardLo >= lo) // Lower band
-                || 
-                (readout >= hi && readout - config.guardHi <= hi) // Upper band
-            )
-        )
+        }
+#if NORMALLY_LOW == 1
+        compensation[crosstalk[i].victim % MATRIX_COLS] += (excursion * crosstalk[i].coefficient) >> 8;
+#else
+        compensation[crosstalk[i].victim % MATRIX_COLS] -= (excursion * crosstalk[i].coefficient) >> 8;
+#endif
+    }
+    return true;
+}
+
+/*
+ * EMI hits the whole row at once, since all columns of a row are read simultaneously.
+ * Estimate that shift as trimmed mean (min and max dropped) of idle keys' deviation from their filtered level.
+ * Pressed and disabled keys don't vote. Needs 3 voters, otherwise no correction.
+ */
+static inline int16_t common_mode_offset(uint8_t row, int16_t *readouts, const uint8_t *columns, uint32_t row_status, int16_t known_offset)
+{
+    int16_t sum = 0, min = INT16_MAX, max = INT16_MIN;
+    uint8_t voters = 0;
+    row_status |= unmapped_columns;
+    for (uint8_t col = 0; col < MATRIX_COLS; col++)
+    {
+        if ((row_status & (1 << col)) || config.deadBandHi[row][col] == 0)
         {
             continue;
         }
+        int16_t deviation = readouts[columns[col]] - known_offset - (matrix[row][col] >> COMMONSENSE_IIR_ORDER);
+        sum += deviation;
+        if (deviation < min) min = deviation;
+        if (deviation > max) max = deviation;
+        voters++;
+    }
+    if (voters < 3)
+    {
+        return 0;
+    }
+    return (sum - min - max) / (voters - 2);
+}
+
+/*
+ * One key of the row. Always inlined into process_row with constant col - board kernel unrolls the column loop,
+ * so column masks and column offsets fold into constants. Row is still a runtime index.
+ */
+static inline __attribute__((always_inline)) void process_key(uint8_t row, uint8_t col, int16_t readout, const int16_t *compensation, uint32_t skip, uint32_t mute, bool prime, uint8_t rate, uint32_t *row_status)
+{
+    // Here you need matrix-sized array of uint8!! matrix[][] won't do!!
+    register uint8_t key_index = (uint32)&config.deadBandHi[row][col] - (uint32)&config.deadBandHi;
+    register uint8_t hi = config.deadBandHi[row][col];
+    register uint8_t lo = config.deadBandLo[row][col];
+    if (hi == 0 || (skip & (1 << col)))
+    {
+        return;
+    }
+    if (compensation != NULL)
+    {
+        readout -= compensation[col];
+    }
+    // Anything off the rest band wakes the governor - don't wait for the filter to call it a keypress.
+#if NORMALLY_LOW == 1
+    scan_activity |= (readout > lo);
+#else
+    scan_activity |= (readout < hi);
+#endif
+    if (
+        !(
+            (readout <= lo && readout + config.guardLo >= lo) // Lower band
+            || 
+            (readout >= hi && readout - config.guardHi <= hi) // Upper band
+        )
+    )
+    {
+        return;
+    }
 #if COMMONSENSE_IIR_ORDER == 0
-        // Degenerate version. But very fast! Can be used in noiseless environments.
-        matrix_ptr[key_index] = readout;
+    // Degenerate version. But very fast! Can be used in noiseless environments.
+    matrix_ptr[key_index] = readout;
 #else
+    if (prime)
+    {
+        // Steady state of the filter below.
+        matrix_ptr[key_index] = readout << COMMONSENSE_IIR_ORDER;
+        iir_carry[row][col] = 0;
+    }
+    else if (rate == 1)
+    {
         // IIR filter - readable version minimizing array lookups.
         readout -= (matrix_ptr[key_index] >> COMMONSENSE_IIR_ORDER);
         matrix_ptr[key_index] += readout;
+    }
+    else
+    {
+        // Hot row - same filter, step split over rate samples.
+        int16_t step = readout - (matrix_ptr[key_index] >> COMMONSENSE_IIR_ORDER) + iir_carry[row][col];
+        readout = step / rate;
+        iir_carry[row][col] = step - readout * rate;
+        matrix_ptr[key_index] += readout;
+    }
 #endif
 //Key pressed?
 #if NORMALLY_LOW == 1
-        if (matrix_ptr[key_index] >= (hi << COMMONSENSE_IIR_ORDER))
+    if (matrix_ptr[key_index] >= (hi << COMMONSENSE_IIR_ORDER))
 #else
-        if (matrix_ptr[key_index] <= (lo << COMMONSENSE_IIR_ORDER))
+    if (matrix_ptr[key_index] <= (lo << COMMONSENSE_IIR_ORDER))
 #endif
+    {
+        if ((*row_status & (1 << col)) == 0)
         {
-            if ((row_status & (1 << current_col)) == 0)
+    // new keypress
+            count_key_event(row, col);
+            if ((mute & (1 << col)) == 0)
             {
-        // new keypress
                 append_scancode(key_index);
+            }
 #ifdef MATRIX_LEVELS_DEBUG
-                level_buffer[scancode_buffer_writepos] = matrix_ptr[key_index] & 0xff;
-                level_buffer_inst[scancode_buffer_writepos] = readout & 0xff;
+            level_buffer[scancode_buffer_writepos] = matrix_ptr[key_index] & 0xff;
+            level_buffer_inst[scancode_buffer_writepos] = readout & 0xff;
 #endif
-                row_status |= (1 << current_col);
-            }
+            *row_status |= (1 << col);
         }
-        else
+    }
+    else
+    {
+        if ((*row_status & (1 << col)) > 0)
         {
-            if ((row_status & (1 << current_col)) > 0)
+    // new key release
+            count_key_event(row, col);
+            if ((mute & (1 << col)) == 0)
             {
-        // new key release
                 append_scancode(KEY_UP_MASK|key_index);
+            }
 #ifdef MATRIX_LEVELS_DEBUG
-                level_buffer[scancode_buffer_writepos] = matrix_ptr[key_index] & 0xff;
-                level_buffer_inst[scancode_buffer_writepos] = readout & 0xff;
+            level_buffer[scancode_buffer_writepos] = matrix_ptr[key_index] & 0xff;
+            level_buffer_inst[scancode_buffer_writepos] = readout & 0xff;
 #endif
-                row_status &= ~(1 << current_col);
+            *row_status &= ~(1 << col);
+        }
+    }
+}
+
+/*
+ * Classifies one row worth of readouts. Columns maps logical column to readout index - column_readout
+ * for the raw Results buffer (physical order, ground channel samples interleaved), identity for decoded buffers.
+ */
+static inline void process_row(uint8_t row, int16_t *readouts, const uint8_t *columns)
+{
+    if (status_register.matrix_output)
+    {
+        // When monitoring matrix we're interested in raw feed.
+        for (uint8_t col = 0; col < MATRIX_COLS; col++)
+        {
+            matrix[row][col] = readouts[columns[col]];
+        }
+        return;
+    }
+    uint32_t row_status = matrix_status[row];
+    uint32_t skip = unmapped_columns;
+    // Quarantined keys are still classified, so health check can see them recover - they just don't make scancodes.
+    uint32_t mute = key_quarantine[row];
+    // Applying offset to readouts is same as shifting thresholds and baselines the other way, but cheaper.
+    int16_t offset = temperature_offset;
+    int16_t compensation[MATRIX_COLS];
+    bool prime = (scan_prime_rows & (1ul << row)) != 0;
+    uint8_t rate = row_rate[row];
+    if (config.capsenseFlags & (1 << CSF_CMR))
+    {
+        offset += common_mode_offset(row, readouts, columns, row_status, offset);
+    }
+    const int16_t *compensate = crosstalk_compensation(row, compensation) ? compensation : NULL;
+#define SCAN_KEY(COL) process_key(row, COL, readouts[columns[COL]] - offset, compensate, skip, mute, prime, rate, &row_status);
+    BOARD_SCAN_COLUMNS(SCAN_KEY)
+#undef SCAN_KEY
+    matrix_status[row] = row_status;
+    if (prime)
+    {
+        scan_prime_rows &= ~(1ul << row);
+    }
+}
+
+static inline void quarantine_key(uint8_t row, uint8_t col)
+{
+    key_quarantine[row] |= (1 << col);
+    xlog(LOG_KEY_QUARANTINED, row * MATRIX_COLS + col, key_events[row][col], key_stuck_windows[row][col]);
+    key_stuck_windows[row][col] = 0;
+    if (matrix_status[row] & (1 << col))
+    {
+        // Don't leave it stuck at the host. Classifier keeps its own idea of the key from now on, muted.
+        append_scancode(KEY_UP_MASK | (row * MATRIX_COLS + col));
+    }
+}
+
+/*
+ * Runs once per health window. Event storm (shorted column, damaged pad chattering) is caught by event count,
+ * stuck key - by being held through whole windows without a single event. Quarantine lifts by itself
+ * once the key is released and calm for KEY_RECOVERY_WINDOWS - a modifier held on purpose comes back on release.
+ */
+static void check_key_health(void)
+{
+    uint8_t event_limit = (config.keyEventLimit == EMPTY_FLASH_BYTE) ? KEY_EVENT_LIMIT_DEFAULT : config.keyEventLimit;
+    // 0 would quarantine every key held for a second.
+    uint8_t stuck_timeout = (config.stuckKeyTimeout == EMPTY_FLASH_BYTE) ? 0 : config.stuckKeyTimeout;
+    for (uint8_t i = 0; i < MATRIX_ROWS; i++)
+    {
+        for (uint8_t j = 0; j < MATRIX_COLS; j++)
+        {
+            if (key_quarantine[i] & (1 << j))
+            {
+                // Counts calm windows while quarantined. Released and no storm - back in service.
+                if ((matrix_status[i] & (1 << j)) == 0 && key_events[i][j] <= event_limit)
+                {
+                    if (++key_stuck_windows[i][j] >= KEY_RECOVERY_WINDOWS)
+                    {
+                        key_quarantine[i] &= ~(1 << j);
+                        key_stuck_windows[i][j] = 0;
+                        xlog(LOG_KEY_RECOVERED, i * MATRIX_COLS + j);
+                    }
+                }
+                else
+                {
+                    key_stuck_windows[i][j] = 0;
+                }
+                continue;
+            }
+            if ((key_held_whole_window[i] & (1 << j)) && key_events[i][j] == 0)
+            {
+                if (key_stuck_windows[i][j] < UINT8_MAX)
+                {
+                    key_stuck_windows[i][j]++;
+                }
+                if (stuck_timeout != 0 && key_stuck_windows[i][j] >= stuck_timeout)
+                {
+                    quarantine_key(i, j);
+                }
+            }
+            else
+            {
+                key_stuck_windows[i][j] = 0;
+            }
+            if (key_events[i][j] > event_limit)
+            {
+                quarantine_key(i, j);
             }
         }
+        key_held_whole_window[i] = matrix_status[i];
     }
-    matrix_status[reading_row] = row_status;
-    if (reading_row == 0)
+    memset(key_events, 0, sizeof(key_events));
+}
+
+static inline void scan_pass_complete(void)
+{
+    uint32_t row_status = 0;
+    for (uint8_t i = 0; i < MATRIX_ROWS; i++)
+    {
+        row_status |= matrix_status[i];
+        key_held_whole_window[i] &= matrix_status[i];
+    }
+    scan_passes++;
+    trace(TRACE_SCAN_PASS, 1, scan_passes);
+    if (scan_pass_faulted)
     {
-        // End of matrix reading cycle.
-        row_status = 0;
-        for (uint8_t i = 0; i < MATRIX_ROWS; i++)
+        scan_pass_faulted = false;
+        scan_integrity.passesFaulted++;
+    }
+    if (systime - key_health_window_start >= KEY_HEALTH_WINDOW)
+    {
+        key_health_window_start = systime;
+        check_key_health();
+        perf.scanPassesPerSecond = scan_passes;
+        scan_passes = 0;
+        if (!scan_window_faulted && scan_slack > 0)
         {
-            row_status |= matrix_status[i];
+            // Clean second - try running tighter.
+            scan_slack--;
+            scan_integrity.slack = scan_slack;
         }
-        if (row_status == 0 && matrix_was_active)
+        scan_window_faulted = false;
+    }
+    if (row_status == 0 && matrix_was_active)
+    {
+        // Signal that last key was released
+        append_scancode(KEY_UP_MASK|COMMONSENSE_NOKEY);
+    }
+    matrix_was_active = row_status > 0 ? true : false;
+    scan_pass_done = true;
+    if (scan_activity || matrix_was_active)
+    {
+        scan_activity = false;
+        scan_active_time = systime;
+        if (scan_rate != 0)
         {
-            // Signal that last key was released
-            append_scancode(KEY_UP_MASK|COMMONSENSE_NOKEY);
+            scan_rate = 0;
+            trace(TRACE_SCAN_RATE, 0, 0);
+            // Pass has already stopped at row 0 - kick free-running scan right away.
+            scan_start();
         }
-        matrix_was_active = row_status > 0 ? true : false;
+    }
+}
+
+static inline void selftest_sample_row(uint8_t row, const int16_t *readouts, const uint8_t *columns)
+{
+    for (uint8_t col = 0; col < MATRIX_COLS; col++)
+    {
+        uint16_t readout = readouts[columns[col]];
+        if (readout < selftest_keys[row][col].min)
+        {
+            selftest_keys[row][col].min = readout;
+        }
+        if (readout > selftest_keys[row][col].max)
+        {
+            selftest_keys[row][col].max = readout;
+        }
+        selftest_keys[row][col].sum += readout;
+        selftest_keys[row][col].sum_squares += (uint32_t)readout * readout;
+        if (readout == 0 || readout >= (1 << ADC_RESOLUTION) - 1)
+        {
+            selftest_keys[row][col].saturated++;
+        }
+    }
+}
+
+static inline void selftest_time_row(uint8_t row, uint32_t isr_start, uint32_t isr_cycles)
+{
+    selftest_rows[row].period_total += isr_start - selftest_last_readout;
+    selftest_last_readout = isr_start;
+    selftest_rows[row].isr_total += isr_cycles;
+    if (isr_cycles > selftest_rows[row].isr_max)
+    {
+        selftest_rows[row].isr_max = isr_cycles > UINT16_MAX ? UINT16_MAX : isr_cycles;
+    }
+    selftest_rows[row].samples++;
+}
+
+static inline void selftest_pass_complete(void)
+{
+    if (selftest_pending)
+    {
+        // Pass that was running at start is over - next one is all ours.
+        selftest_pending = false;
+        selftest_active = true;
+        selftest_start_cycles = PERF_CYCLES();
+        selftest_last_readout = selftest_start_cycles;
+        return;
+    }
+    if (!selftest_active)
+    {
+        return;
+    }
+    selftest_passes_done++;
+    if (selftest_passes_done >= selftest_passes)
+    {
+        selftest_active = false;
+        selftest_cycles = PERF_CYCLES() - selftest_start_cycles;
+        selftest_done = true;
+    }
+}
+
+static inline void process_results(void)
+{
+#ifdef COMMONSENSE_CDM_MODE
+    // Nothing can be classified until all slots are in.
+    cdm_capture(reading_row);
+    if (reading_row != 0)
+    {
+        return;
+    }
+    cdm_decode();
+    for (uint8_t row = 0; row < MATRIX_ROWS; row++)
+    {
+        if (selftest_active)
+        {
+            selftest_sample_row(row, cdm_values[row], column_identity);
+        }
+        process_row(row, cdm_values[row], column_identity);
+    }
+#else
+    if (selftest_active)
+    {
+        selftest_sample_row(reading_row, Results, column_readout);
+    }
+    process_row(reading_row, Results, column_readout);
+    if (!reading_pass_end)
+    {
+        return;
+    }
+#endif
+    // End of matrix reading cycle.
+    selftest_pass_complete();
+    scan_pass_complete();
+}
+
+CY_ISR(Result_ISR)
+{
+#ifdef DEBUG_INTERRUPTS
+    PIN_DEBUG(1, 2)
+#endif
+#ifdef COMMONSENSE_100KHZ_MODE
+    return;
+    // The rest of the code is dead in 100kHz mode.
+#endif
+    uint32_t isr_start = PERF_CYCLES();
+    bool selftest = selftest_active;
+    uint32_t seq = row_transfer_seq;
+    if (seq - row_processed_seq > 1)
+    {
+        scan_integrity.rowsSkipped += seq - row_processed_seq - 1;
+        scan_fault(SCAN_FAULT_SKIPPED);
+    }
+    process_results();
+    row_processed_seq = seq;
+    // Next conversion ended while we were busy - its readout is late, or lost if it ended twice.
+    // Slack conversions don't count, nothing is read out on them.
+    if ((*EoCIRQ_INTC_SET_PD & EoCIRQ__INTC_MASK) && scan_slack_left == 0 && scan_in_progress)
+    {
+        scan_fault(SCAN_FAULT_OVERRUN);
+    }
+    uint32_t isr_cycles = PERF_CYCLES() - isr_start;
+    if (selftest)
+    {
+        selftest_time_row(reading_row, isr_start, isr_cycles);
+    }
+    perf.isrCyclesTotal += isr_cycles;
+    perf.isrRuns++;
+    if (isr_cycles > perf.isrCyclesMax)
+    {
+        perf.isrCyclesMax = isr_cycles;
     }
 }
 
 void scan_start(void)
 {
+    // Governor may kick scan from Result_ISR.
+    uint8_t enableInterrupts = CyEnterCriticalSection();
     if (!scan_in_progress)
     {
-        driving_row = MATRIX_ROWS - 1; // Zero-based! Adjust!
+        scan_slot = 0;
+        driving_row = scan_schedule[0];
         Drive(driving_row);
         scan_in_progress = true;
     }
+    CyExitCriticalSection(enableInterrupts);
+}
+
+/*
+ * Called from main loop every tick at full throttle. Steps rate down on idle matrix,
+ * starts passes at reduced rates and accounts time spent at each rate.
+ */
+void scan_governor_tick(uint8_t ticks)
+{
+    uint8_t rate = scan_rate;
+    scan_rate_residency_ms[rate] += ticks;
+    if (scan_rate_residency_ms[rate] >= 1000)
+    {
+        scan_rate_residency_ms[rate] -= 1000;
+        perf.scanRateResidency[rate]++;
+    }
+    if (
+        config.scanGovernorIdle == EMPTY_FLASH_BYTE
+        || status_register.matrix_output
+        || status_register.setup_mode
+        || selftest_requested
+    )
+    {
+        if (rate != 0)
+        {
+            scan_rate = 0;
+            scan_start();
+        }
+        perf.scanRate = 0;
+        return;
+    }
+    uint8_t enableInterrupts = CyEnterCriticalSection();
+    // ISR may have just boosted - re-read under lock.
+    rate = scan_rate;
+    if (rate < SCAN_RATES - 1 && systime - scan_active_time >= config.scanGovernorIdle * 100u)
+    {
+        rate++;
+        scan_rate = rate;
+        scan_active_time = systime;
+        scan_rate_countdown = 0;
+        trace(TRACE_SCAN_RATE, rate, 0);
+    }
+    CyExitCriticalSection(enableInterrupts);
+    perf.scanRate = rate;
+    if (rate == 0)
+    {
+        return;
+    }
+    if (scan_rate_countdown > ticks)
+    {
+        scan_rate_countdown -= ticks;
+        return;
+    }
+    scan_rate_countdown = scan_rate_periods[rate];
+    scan_start();
+}
+
+static uint32_t scancode_rows(const uint8_t *scancodes, uint8_t count)
+{
+    uint32_t mask = 0;
+    for (uint8_t i = 0; i < count && scancodes[i] != EMPTY_FLASH_BYTE; i++)
+    {
+        if (scancodes[i] < COMMONSENSE_MATRIX_SIZE)
+        {
+            mask |= 1ul << (scancodes[i] / MATRIX_COLS);
+        }
+    }
+    return mask;
+}
+
+/*
+ * Builds pass schedule over masked rows, top row first. At full matrix hot rows are repeated hotRowRate times,
+ * spread evenly - cold rows are split into hotRowRate chunks with all hot rows in front of each chunk.
+ * Hot keys take 1/hotRowRate of filter step per sample, so noise rejection doesn't change - they get seen sooner
+ * within the pass, not filtered faster. Per-pass bookkeeping
+ * (health windows, pass counters, matrix stream) still runs once per pass.
+ */
+static void scan_set_rows(uint32_t mask)
+{
+    uint32_t hot = 0;
+    uint8_t rate = config.hotRowRate;
+#ifdef COMMONSENSE_CDM_MODE
+    // Every slot drives half the matrix - decoding needs all of them, once.
+    mask = SCAN_ALL_ROWS;
+    rate = 1;
+#endif
+    if (mask == 0)
+    {
+        mask = SCAN_ALL_ROWS;
+    }
+    if (rate > HOT_ROW_RATE_MAX || selftest_requested)
+    {
+        rate = 1;
+    }
+    if (mask == SCAN_ALL_ROWS && rate > 1)
+    {
+        hot = scancode_rows(config.hotKeys, HOT_KEYS_MAX);
+    }
+    uint8_t cold_rows[MATRIX_ROWS];
+    uint8_t cold_count = 0;
+    for (int8_t row = MATRIX_ROWS - 1; row >= 0; row--)
+    {
+        if ((mask & ~hot) & (1ul << row))
+        {
+            cold_rows[cold_count++] = row;
+        }
+    }
+    if (hot == 0)
+    {
+        rate = 1;
+    }
+    uint8_t schedule[sizeof(scan_schedule)];
+    uint8_t length = 0;
+    for (uint8_t chunk = 0; chunk < rate; chunk++)
+    {
+        for (int8_t row = MATRIX_ROWS - 1; row >= 0; row--)
+        {
+            if (hot & (1ul << row))
+            {
+                schedule[length++] = row;
+            }
+        }
+        for (uint8_t i = cold_count * chunk / rate; i < cold_count * (chunk + 1) / rate; i++)
+        {
+            schedule[length++] = cold_rows[i];
+        }
+    }
+    uint8_t enableInterrupts = CyEnterCriticalSection();
+    scan_row_mask = mask;
+    memcpy(scan_schedule, schedule, length);
+    scan_schedule_length = length;
+    for (uint8_t row = 0; row < MATRIX_ROWS; row++)
+    {
+        row_rate[row] = (hot & (1ul << row)) ? rate : 1;
+    }
+    CyExitCriticalSection(enableInterrupts);
+}
+
+bool scan_is_wake_key(uint8_t sc)
+{
+    if (config.wakeKeys[0] == EMPTY_FLASH_BYTE)
+    {
+        return true;
+    }
+    for (uint8_t i = 0; i < WAKE_KEYS_MAX && config.wakeKeys[i] != EMPTY_FLASH_BYTE; i++)
+    {
+        if (config.wakeKeys[i] == sc)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Remote wakeup watch. Only rows with wake keys get scanned, ADCs are powered down between passes.
+ * Without remote wakeup nothing is scanned at all.
+ */
+void scan_suspend(bool watch)
+{
+    uint8_t enableInterrupts = CyEnterCriticalSection();
+    if (selftest_pending || selftest_active)
+    {
+        // Results so far still make sense - summary says how many passes made it.
+        selftest_pending = false;
+        selftest_active = false;
+        selftest_cycles = PERF_CYCLES() - selftest_start_cycles;
+        selftest_done = true;
+    }
+    CyExitCriticalSection(enableInterrupts);
+    if (!watch)
+    {
+        scan_stale_rows = SCAN_ALL_ROWS;
+        return;
+    }
+    scan_set_rows(scancode_rows(config.wakeKeys, WAKE_KEYS_MAX));
+    scan_stale_rows = SCAN_ALL_ROWS & ~scan_row_mask;
+    // Full throttle pass may still be running - ADCs go to sleep only after it's done.
+    scan_pass_done = false;
+}
+
+// Back to whole matrix at full rate, stale rows get primed by the first pass.
+void scan_resume(void)
+{
+    if (scan_adc_asleep)
+    {
+        ADC0_Wakeup();
+        ADC1_Wakeup();
+        scan_adc_asleep = false;
+    }
+    scan_set_rows(SCAN_ALL_ROWS);
+    uint8_t enableInterrupts = CyEnterCriticalSection();
+    scan_prime_rows = scan_stale_rows;
+    scan_stale_rows = 0;
+    scan_rate = 0;
+    scan_active_time = systime;
+    CyExitCriticalSection(enableInterrupts);
+}
+
+uint8_t scan_watch_interval(void)
+{
+    if (config.watchInterval == 0 || config.watchInterval == EMPTY_FLASH_BYTE)
+    {
+        return SUSPEND_SYSTIMER_DIVISOR;
+    }
+    return config.watchInterval;
+}
+
+void scan_watch_start(void)
+{
+    if (scan_adc_asleep)
+    {
+        ADC0_Wakeup();
+        ADC1_Wakeup();
+        scan_adc_asleep = false;
+    }
+    scan_pass_done = false;
+    scan_watch_pass_start = PERF_CYCLES();
+    scan_start();
+}
+
+// True once watch pass is fully processed. Puts ADCs to sleep until next pass.
+bool scan_watch_poll(void)
+{
+    if (!scan_pass_done || scan_adc_asleep)
+    {
+        return false;
+    }
+    scan_watch_pass_cycles = PERF_CYCLES() - scan_watch_pass_start;
+    ADC0_Sleep();
+    ADC1_Sleep();
+    scan_adc_asleep = true;
+    return true;
+}
+
+void scan_watch_log_wake(uint8_t sc)
+{
+    uint32_t pass_us = scan_watch_pass_cycles / (BCLK__BUS_CLK__KHZ / 1000);
+    uint8_t interval = scan_watch_interval();
+    xlog(LOG_WATCH_WAKE, sc, interval * 1000 + pass_us, interval, pass_us);
 }
 
 void scan_reset(void)
@@ -261,19 +1091,192 @@ void scan_reset(void)
     }
     memset(scancode_buffer, COMMONSENSE_NOKEY, sizeof(scancode_buffer));
     memset(matrix_status, 0, sizeof(matrix_status));
+    memset(iir_carry, 0, sizeof(iir_carry));
+    crosstalk_init();
+    column_map_init();
+    scan_set_rows(SCAN_ALL_ROWS);
     scancode_buffer_readpos = 0;
     scancode_buffer_writepos = 0;
     CyExitCriticalSection(enableInterrupts);
 }
 
+/*
+ * Config was swapped under the ISR - caller holds the critical section.
+ * Keys with new thresholds restart from the band midpoint (released if held, quarantine lifted),
+ * the rest keep their filter state.
+ */
+void scan_config_changed(const uint32_t *changed_keys, bool crosstalk_changed)
+{
+    for (uint8_t i = 0; i < MATRIX_ROWS; i++)
+    {
+        if (changed_keys[i] == 0)
+        {
+            continue;
+        }
+        for (uint8_t j = 0; j < MATRIX_COLS; j++)
+        {
+            if ((changed_keys[i] & (1 << j)) == 0)
+            {
+                continue;
+            }
+            matrix[i][j] = (config.deadBandHi[i][j] + config.deadBandLo[i][j]) << (COMMONSENSE_IIR_ORDER - 1);
+            iir_carry[i][j] = 0;
+            if (matrix_status[i] & (1 << j))
+            {
+                append_scancode(KEY_UP_MASK | (i * MATRIX_COLS + j));
+                matrix_status[i] &= ~(1 << j);
+            }
+            key_quarantine[i] &= ~(1 << j);
+            key_stuck_windows[i][j] = 0;
+        }
+    }
+    if (crosstalk_changed)
+    {
+        crosstalk_init();
+    }
+    // Hot keys or column map might have changed. Cheap enough to just rebuild.
+    column_map_init();
+    scan_set_rows(SCAN_ALL_ROWS);
+}
+
 void scan_init(void)
 {
+#ifdef COMMONSENSE_CDM_MODE
+    cdm_init();
+#endif
     InitSensor();
     EnableSensor();
 }
 
+static struct {
+    bool enabled;
+    uint8_t decimation;
+    uint8_t countdown;
+    uint8_t flags;
+    uint16_t sequence;
+} matrix_stream;
+// What host has - last values sent, per key.
+static uint16_t matrix_stream_sent[MATRIX_ROWS][MATRIX_COLS];
+
+void scan_matrix_stream(bool enable, uint8_t decimation, uint8_t flags)
+{
+    matrix_stream.enabled = enable;
+    matrix_stream.decimation = decimation > 0 ? decimation : 1;
+    matrix_stream.countdown = 0;
+#if MATRIX_STREAM_DELTA_ROW_SIZE > MATRIX_FRAME_DATA_SIZE
+    flags &= ~(1 << MSF_DELTA);
+#endif
+    matrix_stream.flags = flags;
+    matrix_stream.sequence = 0;
+}
+
+static inline uint8_t *matrix_stream_put_varint(uint8_t *ptr, uint16_t value)
+{
+    while (value >= 0x80)
+    {
+        *ptr++ = (value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    *ptr++ = value;
+    return ptr;
+}
+
+// Returns bytes used.
+static uint8_t matrix_stream_encode_row(uint8_t row, bool delta, uint8_t *buf)
+{
+    uint8_t *ptr = buf;
+    if (delta)
+    {
+        for (uint8_t col = 0; col < MATRIX_COLS; col++)
+        {
+            uint16_t level = matrix[row][col];
+            int16_t diff = level - matrix_stream_sent[row][col];
+            // Zigzag - small negative numbers become small positive ones.
+            ptr = matrix_stream_put_varint(ptr, ((uint16_t)diff << 1) ^ (uint16_t)(diff >> 15));
+            matrix_stream_sent[row][col] = level;
+        }
+    }
+    else
+    {
+        uint32_t bits = 0;
+        uint8_t bit_count = 0;
+        for (uint8_t col = 0; col < MATRIX_COLS; col++)
+        {
+            int16_t level = matrix[row][col];
+            if (level < 0)
+                level = 0;
+            if (level >= (1 << MATRIX_FRAME_VALUE_BITS))
+                level = (1 << MATRIX_FRAME_VALUE_BITS) - 1;
+            matrix_stream_sent[row][col] = level;
+            bits |= (uint32_t)level << bit_count;
+            bit_count += MATRIX_FRAME_VALUE_BITS;
+            while (bit_count >= 8)
+            {
+                *ptr++ = bits & 0xff;
+                bits >>= 8;
+                bit_count -= 8;
+            }
+        }
+        if (bit_count > 0)
+        {
+            *ptr++ = bits & 0xff;
+        }
+    }
+    return ptr - buf;
+}
+
+static void stream_matrix_readouts(void)
+{
+    if (matrix_stream.countdown > 0)
+    {
+        matrix_stream.countdown--;
+        return;
+    }
+    bool delta = (matrix_stream.flags & (1 << MSF_DELTA))
+              && (matrix_stream.sequence % MATRIX_FRAME_KEYFRAME_INTERVAL != 0);
+    uint8_t rows_per_packet = MATRIX_FRAME_DATA_SIZE / (delta ? MATRIX_STREAM_DELTA_ROW_SIZE : MATRIX_STREAM_KEYFRAME_ROW_SIZE);
+    // Half a frame is worse than none, and skipping a frame doesn't break delta chain - sequence stays.
+    if (usb_c2_free() < (MATRIX_ROWS + rows_per_packet - 1) / rows_per_packet)
+    {
+        return;
+    }
+    matrix_stream.countdown = matrix_stream.decimation - 1;
+    matrix_frame_header_t *header = (matrix_frame_header_t *)outbox.payload;
+    uint8_t *data = outbox.payload + sizeof(matrix_frame_header_t);
+    uint8_t *ptr = data;
+    memset(outbox.raw, 0, sizeof(outbox));
+    outbox.response_type = C2RESPONSE_MATRIX_FRAME;
+    header->sequence = matrix_stream.sequence;
+    header->timestamp = systime;
+    header->cols = MATRIX_COLS;
+    header->flags = delta ? (1 << MSF_DELTA) : 0;
+    for (uint8_t row = 0; row < MATRIX_ROWS; row++)
+    {
+        uint8_t row_data[MATRIX_STREAM_DELTA_ROW_SIZE];
+        uint8_t size = matrix_stream_encode_row(row, delta, row_data);
+        if (ptr + size > data + MATRIX_FRAME_DATA_SIZE)
+        {
+            usb_send_c2();
+            header->firstRow = row;
+            header->rows = 0;
+            ptr = data;
+            memset(data, 0, MATRIX_FRAME_DATA_SIZE);
+        }
+        memcpy(ptr, row_data, size);
+        ptr += size;
+        header->rows++;
+    }
+    usb_send_c2();
+    matrix_stream.sequence++;
+}
+
 void report_matrix_readouts(void)
 {
+    if (matrix_stream.enabled)
+    {
+        stream_matrix_readouts();
+        return;
+    }
     for(uint8 i = 0; i<MATRIX_ROWS; i++)
     {
         outbox.response_type = C2RESPONSE_MATRIX_ROW;
@@ -286,3 +1289,276 @@ void report_matrix_readouts(void)
         usb_send_c2();
     }
 }
+
+void scan_update_temperature(void)
+{
+    static uint32_t last_sample;
+    if (systime - last_sample < TEMPERATURE_SAMPLE_PERIOD)
+    {
+        return;
+    }
+    last_sample = systime;
+    if ((config.capsenseFlags & (1 << CSF_TC)) == 0
+        || (uint8_t)config.temperatureReference == EMPTY_FLASH_BYTE
+        || (uint8_t)config.temperatureSlope == EMPTY_FLASH_BYTE)
+    {
+        temperature_offset = 0;
+        return;
+    }
+    EEPROM_UpdateTemperature();
+    // [0] is sign, 1 is positive. [1] is magnitude, degrees C.
+    int16_t temperature = dieTemperature[0] ? dieTemperature[1] : -dieTemperature[1];
+    temperature_offset = ((temperature - config.temperatureReference) * config.temperatureSlope) / 16;
+}
+
+void report_key_health(void)
+{
+    memset(outbox.raw, 0, sizeof(outbox));
+    outbox.response_type = C2RESPONSE_HEALTH;
+    outbox.payload[0] = MATRIX_ROWS;
+    outbox.payload[1] = MATRIX_COLS;
+    memcpy(&outbox.payload[2], key_quarantine, sizeof(key_quarantine));
+    usb_send_c2();
+}
+
+/*
+ * Self-test. Scan keeps producing scancodes while it runs - it just runs flat out over plain schedule.
+ */
+void scan_selftest_start(uint8_t passes)
+{
+    if (selftest_requested)
+    {
+        return;
+    }
+    selftest_requested = true;
+    // Drop hot rows - every key gets the same number of samples.
+    scan_set_rows(scan_row_mask);
+    memset(selftest_rows, 0, sizeof(selftest_rows));
+    memset(selftest_keys, 0, sizeof(selftest_keys));
+    for (uint8_t i = 0; i < MATRIX_ROWS; i++)
+    {
+        for (uint8_t j = 0; j < MATRIX_COLS; j++)
+        {
+            selftest_keys[i][j].min = UINT16_MAX;
+        }
+    }
+    selftest_passes = passes ? passes : SELFTEST_PASSES_DEFAULT;
+    selftest_passes_done = 0;
+    selftest_faults = 0;
+    selftest_done = false;
+    uint8_t enableInterrupts = CyEnterCriticalSection();
+    if (scan_in_progress)
+    {
+        selftest_pending = true;
+    }
+    else
+    {
+        selftest_active = true;
+        selftest_start_cycles = PERF_CYCLES();
+        selftest_last_readout = selftest_start_cycles;
+    }
+    scan_rate = 0;
+    CyExitCriticalSection(enableInterrupts);
+    scan_start();
+}
+
+static uint16_t selftest_mean(uint8_t row, uint8_t col)
+{
+    return (selftest_keys[row][col].sum << 4) / selftest_passes_done;
+}
+
+static uint16_t selftest_median(uint16_t *levels, uint8_t count)
+{
+    for (uint8_t i = 1; i < count; i++)
+    {
+        for (uint8_t j = i; j > 0 && levels[j - 1] > levels[j]; j--)
+        {
+            uint16_t t = levels[j];
+            levels[j] = levels[j - 1];
+            levels[j - 1] = t;
+        }
+    }
+    return count ? levels[count / 2] : 0;
+}
+
+static bool selftest_suspect(uint32_t level, uint16_t median, bool saturated)
+{
+    return saturated || level * 2 < median || level > median * 2u;
+}
+
+/*
+ * Drive and sense line sanity. Open or shorted line shifts the whole row or column level
+ * far from the rest of the matrix. Unmapped columns and skipped keys don't count.
+ */
+static void selftest_check_lines(void)
+{
+    uint16_t row_levels[MATRIX_ROWS], sorted[MATRIX_ROWS];
+    uint32_t measured_rows = 0;
+    uint32_t col_sum[MATRIX_COLS] = {0};
+    uint8_t col_keys[MATRIX_COLS] = {0};
+    uint32_t col_saturated = ~unmapped_columns & ((uint32_t)((1ull << MATRIX_COLS) - 1));
+    uint8_t rows = 0;
+    selftest_summary.saturatedKeys = 0;
+    selftest_summary.suspectRows = 0;
+    selftest_summary.suspectCols = 0;
+    for (uint8_t i = 0; i < MATRIX_ROWS; i++)
+    {
+        uint32_t sum = 0;
+        uint8_t keys = 0;
+        bool saturated = true;
+        for (uint8_t j = 0; j < MATRIX_COLS; j++)
+        {
+            if (selftest_keys[i][j].saturated)
+            {
+                selftest_summary.saturatedKeys++;
+            }
+            if ((unmapped_columns & (1ul << j)) || config.deadBandLo[i][j] > config.deadBandHi[i][j])
+            {
+                continue;
+            }
+            uint16_t mean = selftest_mean(i, j);
+            sum += mean;
+            keys++;
+            col_sum[j] += mean;
+            col_keys[j]++;
+            if (selftest_keys[i][j].saturated < selftest_passes_done)
+            {
+                saturated = false;
+                col_saturated &= ~(1ul << j);
+            }
+        }
+        if (keys == 0)
+        {
+            continue;
+        }
+        measured_rows |= 1ul << i;
+        row_levels[i] = sum / keys;
+        sorted[rows++] = row_levels[i];
+        if (saturated)
+        {
+            selftest_summary.suspectRows |= 1ul << i;
+        }
+    }
+    uint16_t median = selftest_median(sorted, rows);
+    selftest_summary.levelMedian = median;
+    for (uint8_t i = 0; i < MATRIX_ROWS; i++)
+    {
+        if ((measured_rows & (1ul << i)) && selftest_suspect(row_levels[i], median, false))
+        {
+            selftest_summary.suspectRows |= 1ul << i;
+        }
+    }
+    for (uint8_t j = 0; j < MATRIX_COLS; j++)
+    {
+        if (col_keys[j] && selftest_suspect(col_sum[j] / col_keys[j], median, col_saturated & (1ul << j)))
+        {
+            selftest_summary.suspectCols |= 1ul << j;
+        }
+    }
+}
+
+// Main loop. Wraps up finished test and announces it with the summary chunk.
+void scan_selftest_poll(void)
+{
+    if (!selftest_done)
+    {
+        return;
+    }
+    selftest_done = false;
+    selftest_requested = false;
+    scan_set_rows(scan_row_mask);
+    memset(&selftest_summary, 0, sizeof(selftest_summary));
+    selftest_summary.passes = selftest_passes;
+    selftest_summary.passesDone = selftest_passes_done;
+    selftest_summary.rows = MATRIX_ROWS;
+    selftest_summary.cols = MATRIX_COLS;
+    selftest_summary.adcResolution = ADC_RESOLUTION;
+    selftest_summary.busClockKHz = BCLK__BUS_CLK__KHZ;
+    selftest_summary.durationCycles = selftest_cycles;
+    selftest_summary.faults = selftest_faults;
+    if (selftest_passes_done > 0)
+    {
+        selftest_check_lines();
+    }
+    scan_selftest_send_chunk(0);
+}
+
+#define SELFTEST_ROW_CHUNKS ((MATRIX_ROWS + SELFTEST_ROWS_PER_CHUNK - 1) / SELFTEST_ROWS_PER_CHUNK)
+#define SELFTEST_KEY_CHUNKS ((COMMONSENSE_MATRIX_SIZE + SELFTEST_KEYS_PER_CHUNK - 1) / SELFTEST_KEYS_PER_CHUNK)
+
+void scan_selftest_send_chunk(uint8_t chunk)
+{
+    selftest_chunk_t *response = (selftest_chunk_t *)outbox.payload;
+    memset(outbox.raw, 0, sizeof(outbox));
+    outbox.response_type = C2RESPONSE_SELFTEST;
+    response->chunk = chunk;
+    if (selftest_requested)
+    {
+        // Still running - nothing consistent to give out.
+        response->type = SELFTEST_CHUNK_END;
+    }
+    else if (chunk == 0)
+    {
+        response->type = SELFTEST_CHUNK_SUMMARY;
+        response->summary = selftest_summary;
+    }
+    else if (chunk <= SELFTEST_ROW_CHUNKS)
+    {
+        response->type = SELFTEST_CHUNK_ROWS;
+        response->first = (chunk - 1) * SELFTEST_ROWS_PER_CHUNK;
+        for (uint8_t row = response->first; row < MATRIX_ROWS && response->count < SELFTEST_ROWS_PER_CHUNK; row++)
+        {
+            selftest_row_t *r = &response->rows[response->count++];
+            uint16_t samples = selftest_rows[row].samples;
+            if (samples == 0)
+            {
+                continue;
+            }
+            r->periodCycles = selftest_rows[row].period_total / samples;
+            r->isrCycles = selftest_rows[row].isr_total / samples;
+            r->isrCyclesMax = selftest_rows[row].isr_max;
+        }
+    }
+    else if (chunk <= SELFTEST_ROW_CHUNKS + SELFTEST_KEY_CHUNKS)
+    {
+        response->type = SELFTEST_CHUNK_KEYS;
+        response->first = (chunk - 1 - SELFTEST_ROW_CHUNKS) * SELFTEST_KEYS_PER_CHUNK;
+        for (uint8_t sc = response->first; sc < COMMONSENSE_MATRIX_SIZE && response->count < SELFTEST_KEYS_PER_CHUNK; sc++)
+        {
+            selftest_key_t *k = &response->keys[response->count++];
+            uint8_t row = sc / MATRIX_COLS;
+            uint8_t col = sc % MATRIX_COLS;
+            uint8_t n = selftest_passes_done;
+            if (n == 0)
+            {
+                continue;
+            }
+            k->min = selftest_keys[row][col].min;
+            k->max = selftest_keys[row][col].max;
+            k->mean = selftest_mean(row, col);
+            // n * sum_squares - sum^2 over n^2, in 1/16 counts squared.
+            uint64_t sum = selftest_keys[row][col].sum;
+            uint64_t variance = (((uint64_t)n * selftest_keys[row][col].sum_squares - sum * sum) << 4) / ((uint32_t)n * n);
+            k->variance = variance > UINT16_MAX ? UINT16_MAX : variance;
+            k->saturated = selftest_keys[row][col].saturated;
+        }
+    }
+    else
+    {
+        response->type = SELFTEST_CHUNK_END;
+    }
+    usb_send_c2();
+}
+
+void scan_release_quarantine(void)
+{
+    uint8_t enableInterrupts = CyEnterCriticalSection();
+    for (uint8_t i = 0; i < MATRIX_ROWS; i++)
+    {
+        // Host already has them released - ones still held get pressed anew on next pass.
+        matrix_status[i] &= ~key_quarantine[i];
+    }
+    memset(key_quarantine, 0, sizeof(key_quarantine));
+    memset(key_stuck_windows, 0, sizeof(key_stuck_windows));
+    CyExitCriticalSection(enableInterrupts);
+}
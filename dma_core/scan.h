@@ -25,18 +25,24 @@
 // This is to ease calculations, there are things hardcoded in buffer management!!
 #define NUM_ADCs 2
 
-#define ADC_CHANNELS (MATRIX_COLS / NUM_ADCs)
+// Per ADC, from board profile. Uneven split (say 9 + 7) reads the larger count on both - config.columnMap picks the ones wired.
+#define ADC_CHANNELS BOARD_ADC_CHANNELS
+#define PHYSICAL_COLS (ADC_CHANNELS * NUM_ADCs)
+#if MATRIX_COLS > 32 || MATRIX_COLS > COLUMN_MAP_SIZE
+#error "Column masks are 32 bit"
+#endif
 
 // Should be [number of columns per ADC + 1] * 2 + 1 - so 19 for MF, 27 for BS
 // TRICKY PART: Count7(which is part of PTK) counts down. 
 // So column 0 must be connected to highest input on the MUX
 // MUX input 0 must be connected to ground - we use it to discharge ADC sampling cap.
 // So, scan sequence code sees is ch0-ch1-ch0-ch2-ch0-ch3-ch0..
-#define PTK_CHANNELS (2 * ADC_CHANNELS + 3)
+// Board generator computes it as (2 * ADC_CHANNELS + 3).
+#define PTK_CHANNELS BOARD_PTK_CHANNELS
 
-// For even values of the above - both offsets need to be updated!
-#define ADC_BUF_INITIAL_OFFSET 1
-#define ADC_BUF_INTER_ROW_GAP 3
+// For even values of the above - both offsets need to be updated! Generator refuses even ones.
+#define ADC_BUF_INITIAL_OFFSET BOARD_ADC_BUF_INITIAL_OFFSET
+#define ADC_BUF_INTER_ROW_GAP BOARD_ADC_BUF_INTER_ROW_GAP
 
 // Below is per ADC.
 #define ADC_BUFFER_BYTESIZE (PTK_CHANNELS * 2)
@@ -47,10 +53,48 @@
 // PTK calibration: 5 = 114kHz, 7 - 92kHz, 15 - 52kHz
 #undef COMMONSENSE_100KHZ_MODE
 
+// EXPERIMENTAL: code-division row drive.
+// Instead of one row per slot, every slot drives half the rows (Sylvester-Hadamard pattern, slot 0 drives all)
+// and per-key levels are decoded at the end of the pass. Each key then integrates all MATRIX_ROWS samples,
+// which helps against analog noise but not against ADC quantization - on recorded f122 captures the gain is
+// 0.9-1.2x, run misc/cdm_check.c on your own MatrixStats before enabling. Decoded levels are NOT the same as
+// single-drive levels (row 0 picks up column offset) - recalibrate thresholds with matrix monitor when enabling this!
+#undef COMMONSENSE_CDM_MODE
+#define COMMONSENSE_CDM_ROWS_LOG2 3
+
 #define SCANCODE_BUFFER_END 31
 #define SCANCODE_BUFFER_NEXT(X) ((X + 1) & SCANCODE_BUFFER_END)
 // ^^^ THIS MUST EQUAL 2^n-1!!! Used as bitmask.
 
+#if MATRIX_ROWS > 32
+#error "Row masks are 32 bit"
+#endif
+#define SCAN_ALL_ROWS ((uint32_t)((1ull << MATRIX_ROWS) - 1))
+
+// Scan integrity. Auto-throttle adds a conversion of slack per row on each fault, drops one per clean second.
+#define SCAN_SLACK_MAX 4
+// Conversions EoC_ISR holds a transfer for unprocessed previous row, before giving up on it.
+#define SCAN_TRANSFER_HOLD_MAX 4
+
+// How often to re-read die temperature for threshold compensation, ms.
+#define TEMPERATURE_SAMPLE_PERIOD 1000
+
+// Key health. Keys generating too many events or stuck for too long stop producing scancodes.
+#define KEY_HEALTH_WINDOW 1000
+#define KEY_EVENT_LIMIT_DEFAULT 50
+// Quarantined key released and within event limit for this many windows in a row is back in service.
+#define KEY_RECOVERY_WINDOWS 2
+#if MATRIX_ROWS * 4 + 2 > 63
+#error "Key health report won't fit into one packet"
+#endif
+
+// Delta row worst case is 3 bytes per key. Wider matrices only get keyframes.
+#define MATRIX_STREAM_DELTA_ROW_SIZE (MATRIX_COLS * 3)
+#define MATRIX_STREAM_KEYFRAME_ROW_SIZE ((MATRIX_COLS * MATRIX_FRAME_VALUE_BITS + 7) / 8)
+#if MATRIX_STREAM_KEYFRAME_ROW_SIZE > MATRIX_FRAME_DATA_SIZE
+#error "Matrix row won't fit into stream packet"
+#endif
+
 #undef MATRIX_LEVELS_DEBUG
 uint8_t scancode_buffer[SCANCODE_BUFFER_END + 1];
 #ifdef MATRIX_LEVELS_DEBUG
@@ -63,4 +107,20 @@ uint8_t scancode_buffer_readpos;
 void scan_init(void);
 void scan_start(void);
 void scan_reset(void);
+void scan_config_changed(const uint32_t *changed_keys, bool crosstalk_changed);
 void report_matrix_readouts(void);
+void scan_matrix_stream(bool enable, uint8_t decimation, uint8_t flags);
+void scan_update_temperature(void);
+void report_key_health(void);
+void scan_release_quarantine(void);
+void scan_governor_tick(uint8_t ticks);
+void scan_suspend(bool watch);
+void scan_resume(void);
+uint8_t scan_watch_interval(void);
+void scan_watch_start(void);
+bool scan_watch_poll(void);
+bool scan_is_wake_key(uint8_t sc);
+void scan_watch_log_wake(uint8_t sc);
+void scan_selftest_start(uint8_t passes);
+void scan_selftest_poll(void);
+void scan_selftest_send_chunk(uint8_t chunk);
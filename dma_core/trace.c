@@ -0,0 +1,118 @@
+/*
+ *
+ * Copyright (C) 2017 DMA <dma@ya.ru>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation. 
+*/
+
+#include <string.h>
+#include <project.h>
+#include "globals.h"
+#include "PSoC_USB.h"
+
+#include "trace.h"
+
+/*
+ * Flight recorder - last TRACE_BUFFER_SIZE events, overwritten in circle.
+ * Recording is armed at boot so there's something to look at when the key goes missing.
+ */
+static trace_event_t trace_buffer[TRACE_BUFFER_SIZE];
+static uint16_t trace_writepos;
+static bool trace_wrapped;
+//Checked by ISR!
+static volatile bool trace_armed;
+
+void trace_init(void)
+{
+    trace_arm();
+}
+
+// systime of last recorded event. Caller holds the critical section.
+static uint32_t trace_last_systime;
+static bool trace_time_marked;
+
+static void trace_record(uint8_t type, uint32_t timestamp, uint8_t arg8, uint16_t arg16)
+{
+    trace_event_t *event = &trace_buffer[trace_writepos];
+    event->timestamp = timestamp;
+    event->type = type;
+    event->arg8 = arg8;
+    event->arg16 = arg16;
+    trace_writepos = TRACE_BUFFER_NEXT(trace_writepos);
+    if (trace_writepos == 0)
+    {
+        trace_wrapped = true;
+    }
+}
+
+/*
+ * Called from ISRs and main loop alike - slot reservation must be atomic.
+ * Back to back scan passes fold into one entry, so idle matrix doesn't flush the timeline out.
+ * Cycle counter wraps in under a minute - after a long quiet spell events are preceded by a time mark.
+ */
+void trace(uint8_t type, uint8_t arg8, uint16_t arg16)
+{
+    if (!trace_armed)
+    {
+        return;
+    }
+    uint8_t enableInterrupts = CyEnterCriticalSection();
+    uint32_t now = PERF_CYCLES();
+    if (type == TRACE_SCAN_PASS && (trace_writepos > 0 || trace_wrapped))
+    {
+        trace_event_t *last = &trace_buffer[(trace_writepos - 1) & (TRACE_BUFFER_SIZE - 1)];
+        if (last->type == TRACE_SCAN_PASS && last->arg8 < UINT8_MAX && systime - trace_last_systime < TRACE_TIME_MARK_MS)
+        {
+            last->timestamp = now;
+            last->arg8++;
+            last->arg16 = arg16;
+            trace_last_systime = systime;
+            CyExitCriticalSection(enableInterrupts);
+            return;
+        }
+    }
+    if (!trace_time_marked || systime - trace_last_systime >= TRACE_TIME_MARK_MS)
+    {
+        trace_record(TRACE_TIME_MARK, systime, 0, 0);
+        trace_time_marked = true;
+    }
+    trace_last_systime = systime;
+    trace_record(type, now, arg8, arg16);
+    CyExitCriticalSection(enableInterrupts);
+}
+
+void trace_arm(void)
+{
+    trace_armed = false;
+    trace_writepos = 0;
+    trace_wrapped = false;
+    trace_time_marked = false;
+    trace_armed = true;
+}
+
+void trace_freeze(void)
+{
+    trace_armed = false;
+}
+
+void trace_send_chunk(uint16_t chunk)
+{
+    // Download shifting under our feet is useless.
+    trace_freeze();
+    uint16_t count = trace_wrapped ? TRACE_BUFFER_SIZE : trace_writepos;
+    uint16_t oldest = trace_wrapped ? trace_writepos : 0;
+    uint32_t first = (uint32_t)chunk * TRACE_EVENTS_PER_CHUNK;
+    trace_chunk_t *response = (trace_chunk_t *)outbox.payload;
+    memset(outbox.raw, 0, sizeof(outbox));
+    outbox.response_type = C2RESPONSE_TRACE;
+    response->chunk = chunk;
+    response->busClockKHz = BCLK__BUS_CLK__KHZ;
+    for (uint8_t i = 0; i < TRACE_EVENTS_PER_CHUNK && first + i < count; i++)
+    {
+        response->events[i] = trace_buffer[(oldest + first + i) & (TRACE_BUFFER_SIZE - 1)];
+        response->count++;
+    }
+    usb_send_c2();
+}
@@ -0,0 +1,23 @@
+/*
+ *
+ * Copyright (C) 2017 DMA <dma@ya.ru>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation. 
+*/
+
+#pragma once
+#include "globals.h"
+
+// Must be power of 2. 8 bytes per event - 16KB of RAM.
+#define TRACE_BUFFER_SIZE 2048
+#define TRACE_BUFFER_NEXT(X) ((X + 1) & (TRACE_BUFFER_SIZE - 1))
+// Quiet spell after which next event gets a time mark. Well under cycle counter wrap at any bus clock.
+#define TRACE_TIME_MARK_MS 10000u
+
+void trace_init(void);
+void trace(uint8_t type, uint8_t arg8, uint16_t arg16);
+void trace_arm(void);
+void trace_freeze(void);
+void trace_send_chunk(uint16_t chunk);
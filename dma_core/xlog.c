@@ -0,0 +1,98 @@
+/*
+ *
+ * Copyright (C) 2017 DMA <dma@ya.ru>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation. 
+*/
+
+#include <string.h>
+#include <project.h>
+#include "globals.h"
+#include "PSoC_USB.h"
+
+#include "xlog.h"
+
+typedef struct {
+    uint8_t id;
+    uint8_t argc;
+    int32_t args[LOG_MAX_ARGS];
+} log_record_t;
+
+static log_record_t xlog_buffer[XLOG_BUFFER_SIZE];
+// readpos == writepos - empty.
+static uint8_t xlog_readpos;
+static uint8_t xlog_writepos;
+
+void xlog_record(uint8_t id, uint8_t argc, const int32_t *args)
+{
+    if (argc > LOG_MAX_ARGS)
+    {
+        argc = LOG_MAX_ARGS;
+    }
+    uint8_t enableInterrupts = CyEnterCriticalSection();
+    if (XLOG_BUFFER_NEXT(xlog_writepos) == xlog_readpos)
+    {
+        perf.logDrops++;
+        CyExitCriticalSection(enableInterrupts);
+        return;
+    }
+    log_record_t *record = &xlog_buffer[xlog_writepos];
+    record->id = id;
+    record->argc = argc;
+    memcpy(record->args, args, argc * sizeof(int32_t));
+    xlog_writepos = XLOG_BUFFER_NEXT(xlog_writepos);
+    CyExitCriticalSection(enableInterrupts);
+}
+
+// Packs as many records as fit. [count]{[id][argc][argc * int32_t]}
+static void xlog_send(void)
+{
+    memset(outbox.raw, 0, sizeof(outbox));
+    outbox.response_type = C2RESPONSE_LOG;
+    uint8_t pos = 1;
+    while (xlog_readpos != xlog_writepos)
+    {
+        log_record_t *record = &xlog_buffer[xlog_readpos];
+        uint8_t size = 2 + record->argc * sizeof(int32_t);
+        if (pos + size > sizeof(outbox.payload))
+        {
+            break;
+        }
+        outbox.payload[pos] = record->id;
+        outbox.payload[pos + 1] = record->argc;
+        memcpy(&outbox.payload[pos + 2], record->args, record->argc * sizeof(int32_t));
+        pos += size;
+        outbox.payload[0]++;
+        xlog_readpos = XLOG_BUFFER_NEXT(xlog_readpos);
+    }
+    usb_send_c2();
+}
+
+// Main loop only - uses outbox. Waits for idle channel so logs don't crowd out responses.
+void xlog_drain(void)
+{
+    if (xlog_readpos == xlog_writepos || !usb_c2_idle())
+    {
+        return;
+    }
+    xlog_send();
+}
+
+// Blocking version, for when there's no main loop to come back to.
+void xlog_flush(void)
+{
+    while (xlog_readpos != xlog_writepos)
+    {
+        while (usb_c2_free() == 0)
+        {
+            if (power_state != DEVSTATE_FULL_THROTTLE)
+            {
+                return;
+            }
+        }
+        xlog_send();
+    }
+    usb_c2_flush();
+}
@@ -0,0 +1,27 @@
+/*
+ *
+ * Copyright (C) 2017 DMA <dma@ya.ru>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation. 
+*/
+
+#pragma once
+#include "globals.h"
+
+// Must be power of 2.
+#define XLOG_BUFFER_SIZE 32
+#define XLOG_BUFFER_NEXT(X) ((X + 1) & (XLOG_BUFFER_SIZE - 1))
+
+#define XLOG_ARGS(...) ((const int32_t []){0, ##__VA_ARGS__})
+/*
+ * Deferred log - xlog(LOG_KRO); xlog(LOG_EWO, value);
+ * Only message ID and arguments are stored, xlog_drain sends them when control endpoint is free.
+ * Never blocks, drops the message if buffer is full.
+ */
+#define xlog(ID, ...) xlog_record(ID, sizeof(XLOG_ARGS(__VA_ARGS__)) / sizeof(int32_t) - 1, XLOG_ARGS(__VA_ARGS__) + 1)
+
+void xlog_record(uint8_t id, uint8_t argc, const int32_t *args);
+void xlog_drain(void);
+void xlog_flush(void);
@@ -0,0 +1,138 @@
+#!/usr/bin/env python3
+#
+# Copyright (C) 2016-2017 DMA <dma@ya.ru>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License version 2 as
+# published by the Free Software Foundation.
+#
+# Generates dma_core/board.h from a board profile (misc/boards/*.board).
+# Firmware pre-build step runs it, so board.h always matches selected profile.
+#
+# Usage: board_gen.py <profile> [output]
+
+import os
+import sys
+
+SWITCH_TYPES = {
+    'beamspring': 'BEAMSPRING',
+    'buckling_spring': 'BUCKLING_SPRING',
+}
+NUM_ADCS = 2
+# 24 column pins, split between 2 ADC muxes.
+MAX_ADC_CHANNELS = 12
+# One 8-bit drive register.
+MAX_ROWS = 8
+MAX_LAYERS = 4
+
+
+def fail(message):
+    sys.stderr.write('board_gen: %s\n' % message)
+    sys.exit(1)
+
+
+def read_profile(path):
+    profile = {}
+    with open(path) as f:
+        for lineno, line in enumerate(f, 1):
+            line = line.split('#', 1)[0].strip()
+            if not line:
+                continue
+            if '=' not in line:
+                fail('%s:%d: expected "key = value"' % (path, lineno))
+            key, value = line.split('=', 1)
+            profile[key.strip()] = value.strip()
+    return profile
+
+
+def parse_int(profile, key, low, high):
+    try:
+        value = int(profile[key], 0)
+    except KeyError:
+        fail('"%s" is missing' % key)
+    except ValueError:
+        fail('"%s" must be a number' % key)
+    if not low <= value <= high:
+        fail('"%s" must be %d..%d' % (key, low, high))
+    return value
+
+
+def generate(profile, source):
+    switch = profile.get('switch', '')
+    if switch not in SWITCH_TYPES:
+        fail('"switch" must be one of: %s' % ', '.join(sorted(SWITCH_TYPES)))
+    rows = parse_int(profile, 'rows', 1, MAX_ROWS)
+    cols = parse_int(profile, 'cols', 1, MAX_ADC_CHANNELS * NUM_ADCS)
+    layers = parse_int(profile, 'layers', 1, MAX_LAYERS)
+    unused = set()
+    for col in profile.get('unused_cols', '').replace(',', ' ').split():
+        try:
+            unused.add(int(col, 0))
+        except ValueError:
+            fail('"unused_cols" must be a list of numbers')
+    if any(col >= cols for col in unused):
+        fail('"unused_cols" must be below %d' % cols)
+    if rows * cols > 0x80:
+        fail('matrix too big - scancodes are 7 bit')
+
+    # Uneven split reads the larger count on both ADCs.
+    adc_channels = (cols + NUM_ADCS - 1) // NUM_ADCS
+    # Ground between every column, plus the lead-in. See scan.h.
+    ptk_channels = 2 * adc_channels + 3
+    if ptk_channels % 2 == 0:
+        fail('even PTK channel count - buffer offsets would need to change')
+    # Same order process_row always used - top column first.
+    kernel = ' '.join('X(%d)' % col for col in reversed(range(cols)) if col not in unused)
+
+    return '''/*
+ * Generated by misc/board_gen.py from {source} - do not edit, change the profile instead.
+ */
+#pragma once
+
+#define BOARD_NAME "{name}"
+#define SWITCH_TYPE {switch}
+#define MATRIX_ROWS {rows}
+#define MATRIX_COLS {cols}
+#define MATRIX_LAYERS {layers}
+
+// PTK/DMA layout. TopDesign mux and Count7 period must match - PSoC Creator won't regenerate those.
+#define BOARD_ADC_CHANNELS {adc_channels}
+#define BOARD_PTK_CHANNELS {ptk_channels}
+#define BOARD_ADC_BUF_INITIAL_OFFSET 1
+#define BOARD_ADC_BUF_INTER_ROW_GAP 3
+
+// Scan kernel - columns process_row unrolls, in scan order. Unused columns are not there at all.
+#define BOARD_SCAN_COLUMNS(X) {kernel}
+#define BOARD_UNUSED_COLUMNS 0x{unused_mask:08x}ul
+'''.format(
+        source=source,
+        name=profile.get('name', os.path.splitext(os.path.basename(source))[0]),
+        switch=SWITCH_TYPES[switch],
+        rows=rows,
+        cols=cols,
+        layers=layers,
+        adc_channels=adc_channels,
+        ptk_channels=ptk_channels,
+        kernel=kernel,
+        unused_mask=sum(1 << col for col in unused),
+    )
+
+
+def main():
+    if len(sys.argv) not in (2, 3):
+        fail('usage: board_gen.py <profile> [output]')
+    here = os.path.dirname(os.path.abspath(__file__))
+    source = sys.argv[1]
+    output = sys.argv[2] if len(sys.argv) == 3 else os.path.join(here, '..', 'dma_core', 'board.h')
+    header = generate(read_profile(source), os.path.relpath(os.path.abspath(source), os.path.join(here, '..')))
+    # Don't touch the file if nothing changed - keeps incremental builds incremental.
+    if os.path.exists(output):
+        with open(output) as f:
+            if f.read() == header:
+                return
+    with open(output, 'w') as f:
+        f.write(header)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,237 @@
+/*
+ *
+ * Copyright (C) 2017 DMA <dma@ya.ru>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+*/
+
+/*
+ * Checks code-division drive decode (dma_core/cdm.h, same code firmware runs) before anybody flips
+ * COMMONSENSE_CDM_MODE on real hardware.
+ *
+ * For synthetic levels and for every MatrixStats capture given:
+ *  - noiseless slot sums must decode back to per-key levels exactly;
+ *  - with noise modelled from the capture (sigma = (max - min) / 6 per key, added once per ADC reading),
+ *    decoded levels are compared with single-row drive at the same number of readings.
+ *
+ * Build and run from repo root:
+ *   cc -O2 -o cdm_check misc/cdm_check.c -lm
+ *   ./cdm_check Underlying-Data/MatrixStats/f122-no1-resting.csv ...
+ * Exit status is non-zero if any exact decode fails.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MATRIX_ROWS 8
+#define MATRIX_COLS 16
+#define COMMONSENSE_CDM_ROWS_LOG2 3
+#define ADC_MAX 1023
+#define PASSES 10000
+
+#include "../dma_core/cdm.h"
+
+static uint8_t patterns[MATRIX_ROWS];
+
+// Deterministic, so results are comparable between runs.
+static uint32_t rng_state = 12345;
+
+static double uniform(void)
+{
+    rng_state = rng_state * 1664525u + 1013904223u;
+    return ((rng_state >> 8) + 0.5) / 16777216.0;
+}
+
+static double gauss(void)
+{
+    return sqrt(-2.0 * log(uniform())) * cos(2.0 * M_PI * uniform());
+}
+
+static int16_t reading(double level, double sigma)
+{
+    long r = lround(level + sigma * gauss());
+    return r < 0 ? 0 : (r > ADC_MAX ? ADC_MAX : r);
+}
+
+static void drive(const int16_t levels[MATRIX_ROWS][MATRIX_COLS], int16_t slots[MATRIX_ROWS][MATRIX_COLS])
+{
+    for (uint8_t k = 0; k < MATRIX_ROWS; k++)
+    {
+        for (uint8_t col = 0; col < MATRIX_COLS; col++)
+        {
+            slots[k][col] = 0;
+            for (uint8_t r = 0; r < MATRIX_ROWS; r++)
+            {
+                if (patterns[k] & (1 << r))
+                {
+                    slots[k][col] += levels[r][col];
+                }
+            }
+        }
+    }
+}
+
+// Returns number of mismatching keys.
+static int check_exact(const char *name, const int16_t levels[MATRIX_ROWS][MATRIX_COLS])
+{
+    int16_t slots[MATRIX_ROWS][MATRIX_COLS];
+    int bad = 0;
+    drive(levels, slots);
+    cdm_decode_values(slots);
+    for (uint8_t r = 0; r < MATRIX_ROWS; r++)
+    {
+        for (uint8_t col = 0; col < MATRIX_COLS; col++)
+        {
+            if (slots[r][col] != levels[r][col])
+            {
+                if (bad < 5)
+                {
+                    printf("  %s: row %d col %d decoded %d, expected %d\n", name, r, col, slots[r][col], levels[r][col]);
+                }
+                bad++;
+            }
+        }
+    }
+    printf("%s: exact decode %s\n", name, bad ? "FAILED" : "ok");
+    return bad;
+}
+
+/*
+ * Slot readings get noise of the column (mean sigma over rows) - it's sense side noise,
+ * doesn't add up with number of rows driven. Crosstalk between driven rows isn't modelled.
+ */
+static void compare_noise(const char *name, const double level[MATRIX_ROWS][MATRIX_COLS],
+                          const double sigma[MATRIX_ROWS][MATRIX_COLS], uint8_t cols)
+{
+    double err_single = 0, err_cdm = 0;
+    long samples = 0;
+    for (uint8_t col = 0; col < cols; col++)
+    {
+        double col_sigma = 0;
+        for (uint8_t r = 0; r < MATRIX_ROWS; r++)
+        {
+            col_sigma += sigma[r][col] / MATRIX_ROWS;
+        }
+        for (int pass = 0; pass < PASSES; pass++)
+        {
+            int16_t slots[MATRIX_ROWS][MATRIX_COLS] = {{0}};
+            for (uint8_t k = 0; k < MATRIX_ROWS; k++)
+            {
+                double sum = 0;
+                for (uint8_t r = 0; r < MATRIX_ROWS; r++)
+                {
+                    if (patterns[k] & (1 << r))
+                    {
+                        sum += level[r][col];
+                    }
+                }
+                slots[k][col] = reading(sum, col_sigma);
+            }
+            cdm_decode_values(slots);
+            for (uint8_t r = 0; r < MATRIX_ROWS; r++)
+            {
+                double d = reading(level[r][col], col_sigma) - level[r][col];
+                err_single += d * d;
+                d = slots[r][col] - level[r][col];
+                err_cdm += d * d;
+                samples++;
+            }
+        }
+    }
+    err_single = sqrt(err_single / samples);
+    err_cdm = sqrt(err_cdm / samples);
+    printf("%s: rms error single %.3f, CDM %.3f counts (%.2fx)\n", name, err_single, err_cdm, err_single / err_cdm);
+}
+
+static int check_capture(const char *path)
+{
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+    {
+        perror(path);
+        return 1;
+    }
+    double level[MATRIX_ROWS][MATRIX_COLS] = {{0}};
+    double sigma[MATRIX_ROWS][MATRIX_COLS] = {{0}};
+    int16_t levels[MATRIX_ROWS][MATRIX_COLS] = {{0}};
+    int rows = 0, cols = 0;
+    char line[256];
+    while (fgets(line, sizeof(line), f))
+    {
+        int r, c, min, max, avg;
+        long sum, count;
+        if (sscanf(line, "%d,%d,%d,%d,%d,%ld,%ld", &r, &c, &min, &max, &avg, &sum, &count) != 7)
+        {
+            continue;
+        }
+        if (r < 0 || r >= MATRIX_ROWS || c < 0 || c >= MATRIX_COLS)
+        {
+            printf("%s: key %d,%d doesn't fit %dx%d matrix, skipped\n", path, r, c, MATRIX_ROWS, MATRIX_COLS);
+            fclose(f);
+            return 0;
+        }
+        rows = r + 1 > rows ? r + 1 : rows;
+        cols = c + 1 > cols ? c + 1 : cols;
+        if (count <= 0)
+        {
+            // No switch there - nothing coupled, reads as zero.
+            continue;
+        }
+        level[r][c] = (double)sum / count;
+        sigma[r][c] = (max - min) / 6.0;
+        levels[r][c] = lround(level[r][c]);
+    }
+    fclose(f);
+    if (rows != MATRIX_ROWS)
+    {
+        printf("%s: %d rows, code-division needs %d - skipped\n", path, rows, MATRIX_ROWS);
+        return 0;
+    }
+    int bad = check_exact(path, levels);
+    compare_noise(path, level, sigma, cols);
+    return bad;
+}
+
+int main(int argc, char **argv)
+{
+    int bad = 0;
+    int16_t levels[MATRIX_ROWS][MATRIX_COLS];
+    cdm_build_patterns(patterns);
+    // Worst case for int16 intermediates - everything at ADC rail.
+    for (uint8_t r = 0; r < MATRIX_ROWS; r++)
+    {
+        for (uint8_t col = 0; col < MATRIX_COLS; col++)
+        {
+            levels[r][col] = ADC_MAX;
+        }
+    }
+    bad += check_exact("synthetic, all at rail", levels);
+    for (int trial = 0; trial < 1000; trial++)
+    {
+        for (uint8_t r = 0; r < MATRIX_ROWS; r++)
+        {
+            for (uint8_t col = 0; col < MATRIX_COLS; col++)
+            {
+                levels[r][col] = uniform() * (ADC_MAX + 1);
+            }
+        }
+        int16_t slots[MATRIX_ROWS][MATRIX_COLS];
+        drive(levels, slots);
+        cdm_decode_values(slots);
+        if (memcmp(slots, levels, sizeof(slots)) != 0)
+        {
+            bad += check_exact("synthetic, random", levels);
+            break;
+        }
+    }
+    printf("synthetic, 1000 random matrices: exact decode %s\n", bad ? "FAILED" : "ok");
+    for (int i = 1; i < argc; i++)
+    {
+        bad += check_capture(argv[i]);
+    }
+    return bad ? 1 : 0;
+}
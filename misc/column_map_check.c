@@ -0,0 +1,83 @@
+/*
+ *
+ * Copyright (C) 2017 DMA <dma@ya.ru>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+*/
+
+/*
+ * Runs column maps through dma_core/column_map.h - same code config apply and column_map_init use.
+ * Board here is 7 + 7 columns on two 8-channel ADCs: physical channels go up to 15, past MATRIX_COLS.
+ *
+ * Build and run from repo root:
+ *   cc -o column_map_check misc/column_map_check.c && ./column_map_check
+ * Exit status is non-zero if any case fails.
+ */
+
+#include <stdio.h>
+
+#include "../c2/nvram.h"
+
+#define MATRIX_COLS 14
+#define ADC_CHANNELS 8
+#define PHYSICAL_COLS (ADC_CHANNELS * 2)
+
+#include "../dma_core/column_map.h"
+
+#define X EMPTY_FLASH_BYTE
+
+/*
+ * expected_bad - column apply must refuse, MATRIX_COLS if map must pass.
+ * expected - physical channel column_map_init gets for each column when it passes.
+ */
+static int run(const char *name, const uint8_t map[COLUMN_MAP_SIZE], uint8_t expected_bad, const uint8_t expected[MATRIX_COLS])
+{
+    int bad = 0;
+    uint8_t refused = column_map_bad_entry(map);
+    if (refused != expected_bad)
+    {
+        printf("  apply refuses column %d, expected %d\n", refused, expected_bad);
+        bad++;
+    }
+    for (uint8_t col = 0; expected_bad == MATRIX_COLS && col < MATRIX_COLS; col++)
+    {
+        uint8_t physical = column_map_physical(map, col);
+        if (physical != expected[col])
+        {
+            printf("  column %d reads channel %d, expected %d\n", col, physical, expected[col]);
+            bad++;
+        }
+    }
+    printf("%s: %s\n", name, bad ? "FAILED" : "ok");
+    return bad != 0;
+}
+
+int main(void)
+{
+    int bad = 0;
+    {
+        uint8_t map[COLUMN_MAP_SIZE] = {X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X};
+        const uint8_t expected[MATRIX_COLS] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13};
+        bad += run("no map - identity", map, MATRIX_COLS, expected);
+    }
+    {
+        // ADC0 channel 7 and ADC1 channel 7 aren't wired. Logical 13 reads channel 14 - past MATRIX_COLS.
+        uint8_t map[COLUMN_MAP_SIZE] = {0, 1, 2, 3, 4, 5, 6, 8, 9, 10, 11, 12, 13, 14, X, X};
+        const uint8_t expected[MATRIX_COLS] = {0, 1, 2, 3, 4, 5, 6, 8, 9, 10, 11, 12, 13, 14};
+        bad += run("7 + 7 split", map, MATRIX_COLS, expected);
+    }
+    {
+        // Same, with two columns not connected at all.
+        uint8_t map[COLUMN_MAP_SIZE] = {0, 1, X, 3, 4, 5, 6, 8, 9, 10, X, 12, 13, 15, X, X};
+        const uint8_t expected[MATRIX_COLS] = {0, 1, X, 3, 4, 5, 6, 8, 9, 10, X, 12, 13, 15};
+        bad += run("7 + 7 split with holes", map, MATRIX_COLS, expected);
+    }
+    {
+        // Channel 16 doesn't exist on this board.
+        uint8_t map[COLUMN_MAP_SIZE] = {0, 1, 2, 3, 4, 5, 6, 8, 9, 10, 11, 12, 13, 16, X, X};
+        bad += run("channel past the board", map, 13, NULL);
+    }
+    return bad ? 1 : 0;
+}
@@ -0,0 +1,123 @@
+/*
+ *
+ * Copyright (C) 2017 DMA <dma@ya.ru>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+*/
+
+/*
+ * Runs macro bytecode through dma_core/macro.h - same interpreter firmware runs - and compares
+ * queued USB events with what's expected. Mostly about modifiers: whatever a macro presses,
+ * it must release, however it ends.
+ *
+ * Build and run from repo root:
+ *   cc -fgnu89-inline -o macro_check misc/macro_check.c && ./macro_check
+ * Exit status is non-zero if any case fails.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "../c2/c2_protocol.h"
+
+// As in dma_core/pipeline.h.
+#define USBQUEUE_RELEASED_MASK 0x80
+#define MACRO_KEY_UPDOWN_RELEASE 0x20
+
+#define LSHIFT 0x02
+#define LCTRL 0x01
+#define KEY_A 0x04
+#define KEY_B 0x05
+
+static struct {
+    uint16_t delayLib[NUM_DELAYS];
+} config;
+static uint32_t systime;
+
+static char events[1024];
+
+static void queue_usbcode(uint32_t time __attribute__((unused)), uint8_t flags, uint8_t keycode)
+{
+    char event[8];
+    snprintf(event, sizeof(event), "%s%s%02x", events[0] ? " " : "", (flags & USBQUEUE_RELEASED_MASK) ? "-" : "+", keycode);
+    strncat(events, event, sizeof(events) - strlen(events) - 1);
+}
+
+// Subroutines of the case being run. Same format as config.macros.
+static const uint8_t *subroutines;
+static uint16_t subroutines_size;
+
+static const uint8_t *lookup_macro_where(uint8_t flags_mask, uint8_t flags_match, uint8_t keycode)
+{
+    for (uint16_t ptr = 0; ptr < subroutines_size; ptr += subroutines[ptr + 2] + 3)
+    {
+        if (subroutines[ptr] == keycode && (subroutines[ptr + 1] & flags_mask) == flags_match)
+        {
+            return &subroutines[ptr];
+        }
+    }
+    return NULL;
+}
+
+#include "../dma_core/macro.h"
+
+static int run(const char *name, const uint8_t *macro, const uint8_t *subs, uint16_t subs_size, const char *expected)
+{
+    events[0] = '\0';
+    subroutines = subs;
+    subroutines_size = subs_size;
+    play_macro(macro);
+    bool ok = strcmp(events, expected) == 0;
+    printf("%s: %s\n", name, ok ? "ok" : "FAILED");
+    if (!ok)
+    {
+        printf("  got:      %s\n  expected: %s\n", events, expected);
+    }
+    return !ok;
+}
+
+#define SUB(ID, ...) ID, MACRO_TYPE_SUBROUTINE, sizeof((uint8_t[]){__VA_ARGS__}), __VA_ARGS__
+#define MACRO(...) 0, 0, sizeof((uint8_t[]){__VA_ARGS__}), __VA_ARGS__
+#define RUN(NAME, M, S, EXPECTED) run(NAME, M, S, sizeof(S), EXPECTED)
+
+int main(void)
+{
+    int bad = 0;
+    // Normal return - shift goes up when subroutine does, before the caller carries on.
+    {
+        const uint8_t m[] = {MACRO(MACRO_OP_WRAP, LSHIFT, MACRO_OP_CALL, 1, MACRO_OP_TYPE, KEY_B)};
+        const uint8_t s[] = {SUB(1, MACRO_OP_TYPE, KEY_A)};
+        bad += RUN("wrap+call, subroutine returns", m, s, "+e1 +04 -04 -e1 +05 -05");
+    }
+    // END in subroutine stops the whole macro - caller's wrap must still be released.
+    {
+        const uint8_t m[] = {MACRO(MACRO_OP_WRAP, LSHIFT, MACRO_OP_CALL, 1, MACRO_OP_TYPE, KEY_B)};
+        const uint8_t s[] = {SUB(1, MACRO_OP_TYPE, KEY_A, MACRO_OP_END, MACRO_OP_TYPE, KEY_B)};
+        bad += RUN("wrap+call, subroutine ENDs", m, s, "+e1 +04 -04 -e1");
+    }
+    // Subroutine cut short - type opcode without its key.
+    {
+        const uint8_t m[] = {MACRO(MACRO_OP_WRAP, LSHIFT, MACRO_OP_CALL, 1, MACRO_OP_TYPE, KEY_B)};
+        const uint8_t s[] = {SUB(1, MACRO_OP_TYPE, KEY_A, MACRO_OP_TYPE)};
+        bad += RUN("wrap+call, subroutine truncated", m, s, "+e1 +04 -04 -e1");
+    }
+    // Two levels of wraps, innermost ENDs - both come up, inner first.
+    {
+        const uint8_t m[] = {MACRO(MACRO_OP_WRAP, LCTRL, MACRO_OP_CALL, 1)};
+        const uint8_t s[] = {
+            SUB(1, MACRO_OP_WRAP, LSHIFT, MACRO_OP_CALL, 2),
+            SUB(2, MACRO_OP_TYPE, KEY_A, MACRO_OP_END)
+        };
+        bad += RUN("nested wrap+call, END", m, s, "+e0 +e1 +04 -04 -e1 -e0");
+    }
+    // Wrap as the last thing in truncated subroutine - its own mods are released too.
+    {
+        const uint8_t m[] = {MACRO(MACRO_OP_WRAP, LCTRL, MACRO_OP_CALL, 1)};
+        const uint8_t s[] = {SUB(1, MACRO_OP_WRAP, LSHIFT, MACRO_OP_PRESS)};
+        bad += RUN("wrap+call, wrap then truncated", m, s, "+e0 +e1 -e1 -e0");
+    }
+    return bad ? 1 : 0;
+}